@@ -0,0 +1,162 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* microkvs                                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2021-2024 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author	Andrew D. Zonenberg
+	@brief	Implementation of StorageBank
+ */
+#include <stdint.h>
+#include <string.h>
+#include "StorageBank.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Asynchronous API
+
+/**
+	@brief Starts erasing the bank
+
+	The default implementation erases synchronously, so the operation is complete by the time this returns.
+
+	@return True if the operation was started
+ */
+bool StorageBank::StartErase()
+{
+	OnOperationComplete(Erase());
+	return true;
+}
+
+/**
+	@brief Starts writing data to the bank
+
+	The default implementation writes synchronously, so the operation is complete by the time this returns.
+
+	@return True if the operation was started
+ */
+bool StorageBank::StartWrite(uint32_t offset, const uint8_t* data, uint32_t len)
+{
+	OnOperationComplete(Write(offset, data, len));
+	return true;
+}
+
+/**
+	@brief Starts copying data from flash to this bank
+
+	The default implementation copies synchronously, so the operation is complete by the time this returns.
+
+	@return True if the operation was started
+ */
+bool StorageBank::StartCopy(StorageBank* src, uint32_t srcOffset, uint32_t dstOffset, uint32_t len)
+{
+	OnOperationComplete(Copy(src, srcOffset, dstOffset, len));
+	return true;
+}
+
+/**
+	@brief Records the result of an asynchronous operation and notifies the completion callback, if any.
+
+	Drivers must call this when each operation finishes (before IsBusy() returns false).
+ */
+void StorageBank::OnOperationComplete(bool ok)
+{
+	m_lastResult = ok;
+	if(m_callback)
+		m_callback(this, ok, m_callbackParam);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copying
+
+/**
+	@brief Copies data from flash (in this bank or another) to this bank
+
+	The default implementation reads the source a MICROKVS_COPY_BUFFER_SIZE chunk at a time into RAM (since some parts
+	can't program flash with data read from flash), writes it, and checks it was programmed correctly.
+
+	@param src			Bank to copy from
+	@param srcOffset	Offset of the data in the source bank
+	@param dstOffset	Offset to copy the data to in this bank
+	@param len			Number of bytes to copy
+
+	@return True if the data was copied and verified successfully
+ */
+bool StorageBank::Copy(StorageBank* src, uint32_t srcOffset, uint32_t dstOffset, uint32_t len)
+{
+	uint8_t buf[MICROKVS_COPY_BUFFER_SIZE];
+	for(uint32_t off=0; off<len; off += MICROKVS_COPY_BUFFER_SIZE)
+	{
+		uint32_t chunk = len - off;
+		if(chunk > MICROKVS_COPY_BUFFER_SIZE)
+			chunk = MICROKVS_COPY_BUFFER_SIZE;
+
+		memcpy(buf, src->GetBase() + srcOffset + off, chunk);
+		if(!Write(dstOffset + off, buf, chunk))
+			return false;
+		if(memcmp(m_baseAddress + dstOffset + off, buf, chunk) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Checksumming
+
+/**
+	@brief Feeds more data into a CRC started by CRCStart()
+ */
+uint32_t StorageBank::CRCUpdate(uint32_t crc, const uint8_t* ptr, uint32_t size)
+{
+	uint32_t poly = 0xedb88320;
+
+	for(uint32_t n=0; n < size; n++)
+	{
+		uint8_t d = ptr[n];
+		for(int i=0; i<8; i++)
+		{
+			bool b = ( crc ^ (d >> i) ) & 1;
+			crc >>= 1;
+			if(b)
+				crc ^= poly;
+		}
+	}
+
+	return crc;
+}
+
+/**
+	@brief Returns the final value of a CRC calculated with CRCStart() / CRCUpdate()
+ */
+uint32_t StorageBank::CRCFinal(uint32_t crc)
+{
+	return ~(	((crc & 0x000000ff) << 24) |
+				((crc & 0x0000ff00) << 8) |
+				((crc & 0x00ff0000) >> 8) |
+				 (crc >> 24) );
+}
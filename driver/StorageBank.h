@@ -39,6 +39,16 @@
 #include "../kvs/BankHeader.h"
 #include "../kvs/LogEntry.h"
 
+//Size of the RAM buffer used by the default implementation of StorageBank::Copy().
+//Must be a multiple of the write block size.
+#ifndef MICROKVS_COPY_BUFFER_SIZE
+	#if defined(MICROKVS_WRITE_BLOCK_SIZE) && (MICROKVS_WRITE_BLOCK_SIZE > 64)
+		#define MICROKVS_COPY_BUFFER_SIZE MICROKVS_WRITE_BLOCK_SIZE
+	#else
+		#define MICROKVS_COPY_BUFFER_SIZE 64
+	#endif
+#endif
+
 /**
 	@brief A single "bank" of flash storage.
 
@@ -50,22 +60,72 @@
 	* Memory mapped for reads
 	* Block level erase
 	* Byte level writes
+
+	In addition to the blocking Erase() / Write() calls, an asynchronous API is provided so that long operations (in
+	particular erases) can overlap with other work. Only one asynchronous operation may be outstanding at a time.
+	The default implementation is a synchronous adapter which performs the operation inside StartErase() /
+	StartWrite() and reports completion immediately; drivers for hardware which can erase or program in the background
+	should override StartErase(), StartWrite(), and IsBusy(), and call OnOperationComplete() when done.
+
+	Copy() moves data from flash to flash, e.g. from the active bank to the inactive one during compaction. The default
+	implementation goes through a small RAM buffer and verifies what it programmed; drivers for hardware with DMA or a
+	flash copy engine can override it (and StartCopy()) so the CPU doesn't handle every byte.
  */
 class StorageBank
 {
 public:
+
+	///@brief Callback invoked when an asynchronous operation completes (may be called from interrupt context)
+	typedef void (*CompletionCallback)(StorageBank* bank, bool ok, void* param);
+
 	StorageBank(uint8_t* base, uint32_t size)
 	: m_baseAddress(base)
 	, m_bankSize(size)
+	, m_lastResult(true)
+	, m_callback(nullptr)
+	, m_callbackParam(nullptr)
 	{}
 
 	//Raw block access API (needs to be implemented by derived driver class)
 	virtual bool Erase() =0;
 	virtual bool Write(uint32_t offset, const uint8_t* data, uint32_t len) =0;
 
+	//Asynchronous block access API (default implementation is a synchronous adapter)
+	//Data passed to StartWrite() must remain valid until the operation completes.
+	virtual bool StartErase();
+	virtual bool StartWrite(uint32_t offset, const uint8_t* data, uint32_t len);
+	virtual bool StartCopy(StorageBank* src, uint32_t srcOffset, uint32_t dstOffset, uint32_t len);
+
+	//Flash to flash copy (the source may be another bank, or this one)
+	virtual bool Copy(StorageBank* src, uint32_t srcOffset, uint32_t dstOffset, uint32_t len);
+
+	///@brief Returns true if an asynchronous operation is in progress. Drivers may use this to poll the hardware.
+	virtual bool IsBusy()
+	{ return false; }
+
+	///@brief Returns true if the most recently completed asynchronous operation was successful
+	bool GetLastResult()
+	{ return m_lastResult; }
+
+	///@brief Sets a callback to be invoked when each asynchronous operation completes
+	void SetCompletionCallback(CompletionCallback callback, void* param)
+	{
+		m_callback = callback;
+		m_callbackParam = param;
+	}
+
 	//Checksumming of block content (may be HW accelerated)
 	virtual uint32_t CRC(const uint8_t* ptr, uint32_t size) =0;
 
+	//Incremental checksumming of content which is not available as one contiguous buffer.
+	//CRCFinal(CRCUpdate(CRCStart(), ptr, size)) must give the same result as CRC(ptr, size).
+	//Default implementation is in software, override if the CRC engine supports incremental operation.
+	virtual uint32_t CRCStart()
+	{ return 0xffffffff; }
+
+	virtual uint32_t CRCUpdate(uint32_t crc, const uint8_t* ptr, uint32_t size);
+	virtual uint32_t CRCFinal(uint32_t crc);
+
 	BankHeader* GetHeader()
 	{ return reinterpret_cast<BankHeader*>(m_baseAddress); }
 
@@ -79,11 +139,22 @@ public:
 	{ return m_baseAddress; }
 
 protected:
+	void OnOperationComplete(bool ok);
+
 	///@brief Address of the start of this block
 	uint8_t*	m_baseAddress;
 
 	///@brief Number of bytes of storage available
 	uint32_t	m_bankSize;
+
+	///@brief Result of the most recently completed asynchronous operation
+	volatile bool m_lastResult;
+
+	///@brief Completion callback for asynchronous operations
+	CompletionCallback m_callback;
+
+	///@brief Argument for m_callback
+	void* m_callbackParam;
 };
 
 #endif
@@ -53,6 +53,63 @@ bool TestStorageBank::Write(uint32_t offset, const uint8_t* data, uint32_t len)
 	return true;
 }
 
+bool TestStorageBank::StartErase()
+{
+	return StartOperation(OP_ERASE, m_eraseDelay, 0, nullptr, 0);
+}
+
+bool TestStorageBank::StartWrite(uint32_t offset, const uint8_t* data, uint32_t len)
+{
+	return StartOperation(OP_WRITE, m_writeDelay, offset, data, len);
+}
+
+bool TestStorageBank::StartCopy(StorageBank* src, uint32_t srcOffset, uint32_t dstOffset, uint32_t len)
+{
+	m_pendingSrc = src;
+	return StartOperation(OP_COPY, m_writeDelay, dstOffset, src->GetBase() + srcOffset, len);
+}
+
+bool TestStorageBank::StartOperation(uint8_t op, uint32_t polls, uint32_t offset, const uint8_t* data, uint32_t len)
+{
+	//Only one operation at a time
+	if(m_pendingOp != OP_NONE)
+		return false;
+
+	m_pendingOp = op;
+	m_pendingPolls = polls;
+	m_pendingOffset = offset;
+	m_pendingData = data;
+	m_pendingLen = len;
+
+	//No delay? Complete right away
+	IsBusy();
+	return true;
+}
+
+bool TestStorageBank::IsBusy()
+{
+	if(m_pendingOp == OP_NONE)
+		return false;
+
+	if(m_pendingPolls > 0)
+	{
+		m_pendingPolls --;
+		return true;
+	}
+
+	//Done, actually perform the operation
+	bool ok;
+	if(m_pendingOp == OP_ERASE)
+		ok = Erase();
+	else if(m_pendingOp == OP_COPY)
+		ok = Copy(m_pendingSrc, m_pendingData - m_pendingSrc->GetBase(), m_pendingOffset, m_pendingLen);
+	else
+		ok = Write(m_pendingOffset, m_pendingData, m_pendingLen);
+	m_pendingOp = OP_NONE;
+	OnOperationComplete(ok);
+	return false;
+}
+
 uint32_t TestStorageBank::CRC(const uint8_t* ptr, uint32_t size)
 {
 	uint32_t poly = 0xedb88320;
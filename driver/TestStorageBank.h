@@ -45,12 +45,23 @@
 
 /**
 	@brief A simulated StorageBank backed by RAM
+
+	By default asynchronous operations complete immediately. SetAsyncDelay() simulates slow flash: each operation
+	then stays busy for a set number of IsBusy() polls, and only takes effect on the polled call which completes it.
  */
 class TestStorageBank : public StorageBank
 {
 public:
 	TestStorageBank()
 	: StorageBank(m_data, TEST_BANK_SIZE)
+	, m_eraseDelay(0)
+	, m_writeDelay(0)
+	, m_pendingOp(OP_NONE)
+	, m_pendingPolls(0)
+	, m_pendingOffset(0)
+	, m_pendingData(nullptr)
+	, m_pendingLen(0)
+	, m_pendingSrc(nullptr)
 	{
 		memset(m_data, 0xff, sizeof(m_data));
 	}
@@ -59,13 +70,56 @@ public:
 	virtual bool Write(uint32_t offset, const uint8_t* data, uint32_t len);
 	virtual uint32_t CRC(const uint8_t* ptr, uint32_t size);
 
+	virtual bool StartErase();
+	virtual bool StartWrite(uint32_t offset, const uint8_t* data, uint32_t len);
+	virtual bool StartCopy(StorageBank* src, uint32_t srcOffset, uint32_t dstOffset, uint32_t len);
+	virtual bool IsBusy();
+
+	/**
+		@brief Sets the number of IsBusy() polls asynchronous erase and write operations take to complete
+	 */
+	void SetAsyncDelay(uint32_t erasePolls, uint32_t writePolls)
+	{
+		m_eraseDelay = erasePolls;
+		m_writeDelay = writePolls;
+	}
+
 	#ifdef SIMULATION
 	void Load(const char* path);
 	void Serialize(const char* path);
 	#endif
 
 protected:
-	uint8_t m_data[TEST_BANK_SIZE];
+	bool StartOperation(uint8_t op, uint32_t polls, uint32_t offset, const uint8_t* data, uint32_t len);
+
+	//Real flash banks start on an erase block boundary, so align generously
+	alignas(64) uint8_t m_data[TEST_BANK_SIZE];
+
+	enum
+	{
+		OP_NONE,
+		OP_ERASE,
+		OP_WRITE,
+		OP_COPY
+	};
+
+	///@brief Number of IsBusy() polls an asynchronous erase takes
+	uint32_t m_eraseDelay;
+
+	///@brief Number of IsBusy() polls an asynchronous write takes
+	uint32_t m_writeDelay;
+
+	///@brief Asynchronous operation in progress, if any
+	uint8_t m_pendingOp;
+
+	///@brief Remaining polls until m_pendingOp completes
+	uint32_t m_pendingPolls;
+
+	//Arguments of m_pendingOp
+	uint32_t m_pendingOffset;
+	const uint8_t* m_pendingData;
+	uint32_t m_pendingLen;
+	StorageBank* m_pendingSrc;
 };
 
 #endif
@@ -41,7 +41,68 @@
 
 extern Logger g_log;
 
-#define HEADER_MAGIC 0xc0def00d
+#define HEADER_MAGIC 0xc0def00e
+#define SNAPSHOT_MAGIC 0x4b565353
+
+//Banks written before log entries had a flags field. These are converted to the current format at startup.
+#define LEGACY_HEADER_MAGIC 0xc0def00d
+
+/**
+	@brief Log entry format used in banks with LEGACY_HEADER_MAGIC
+
+	Every object is a plain one. m_headerCRC covers m_key, m_start, and m_len.
+ */
+struct LegacyLogEntry
+{
+	char		m_key[KVS_NAMELEN];
+	uint32_t	m_start;
+	uint32_t	m_len;
+	uint32_t	m_crc;
+	uint32_t	m_headerCRC;
+
+	#ifdef MICROKVS_WRITE_BLOCK_SIZE
+		#if MICROKVS_WRITE_BLOCK_SIZE >= 16
+			uint8_t		m_padding[MICROKVS_WRITE_BLOCK_SIZE - (16 % MICROKVS_WRITE_BLOCK_SIZE)];
+		#endif
+	#endif
+};
+
+//Layout of counter objects (see LogEntry::FLAG_COUNTER)
+#ifdef MICROKVS_WRITE_BLOCK_SIZE
+	#define COUNTER_HEADER_SIZE ( (MICROKVS_WRITE_BLOCK_SIZE > 4) ? MICROKVS_WRITE_BLOCK_SIZE : 4 )
+	#define COUNTER_SIZE (COUNTER_HEADER_SIZE + KVS_COUNTER_INCREMENTS*MICROKVS_WRITE_BLOCK_SIZE)
+#else
+	#define COUNTER_HEADER_SIZE 4
+	#define COUNTER_SIZE (COUNTER_HEADER_SIZE + (KVS_COUNTER_INCREMENTS + 7)/8)
+#endif
+
+//Size of the CRC slots after the content of a rewritable object (see LogEntry::FLAG_REWRITABLE)
+#define REWRITE_SLOTS_SIZE (KVS_REWRITE_SLOTS * sizeof(uint32_t))
+
+//Layout of delta revisions (see LogEntry::FLAG_DELTA): a header, then for each changed range a KVSDeltaRange followed
+//by the new content of the range
+struct KVSDeltaHeader
+{
+	uint32_t	m_size;			//Size of the object
+	uint32_t	m_depth;		//Number of deltas in the chain, including this one
+};
+
+struct KVSDeltaRange
+{
+	uint32_t	m_offset;
+	uint32_t	m_len;
+};
+
+//Size of the chunk CRCs and length after the content of a chunked object (see LogEntry::FLAG_CHUNKED)
+#define CHUNK_TABLE_SIZE(len) ( ( ((len) + KVS_CHUNK_SIZE - 1) / KVS_CHUNK_SIZE + 1) * sizeof(uint32_t) )
+
+//A new revision made by replacing part of the content of an existing one (see KVS::PatchObject)
+struct KVSPatch
+{
+	LogEntry*	m_base;			//Revision to copy unchanged content from
+	uint32_t	m_offset;		//Offset of the new content
+	uint32_t	m_size;			//Size of the new revision
+};
 
 char g_blankKey[KVS_NAMELEN];
 
@@ -57,13 +118,88 @@ template bool KVS::StoreObjectIfNecessary(const char* name, uint16_t currentValu
 
 template bool KVS::StoreObjectIfNecessary(uint16_t currentValue, uint16_t defaultValue, const char* format, ...);
 
-#ifdef STM32L031
-#define BLANK_FLASH_BYTE 0x00
-#define BLANK_FLASH_X32 0x00000000
-#else
-#define BLANK_FLASH_BYTE 0xff
-#define BLANK_FLASH_X32 0xffffffff
-#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sinks for streaming object content
+
+/**
+	@brief Sink which discards data, keeping only its length and CRC
+ */
+class KVSCRCSink : public KVSByteSink
+{
+public:
+	KVSCRCSink(StorageBank* bank)
+	: m_bank(bank)
+	, m_crc(bank->CRCStart())
+	, m_len(0)
+	{}
+
+	virtual bool Write(const uint8_t* data, uint32_t len)
+	{
+		m_crc = m_bank->CRCUpdate(m_crc, data, len);
+		m_len += len;
+		return true;
+	}
+
+	uint32_t GetCRC()
+	{ return m_bank->CRCFinal(m_crc); }
+
+	uint32_t GetLength()
+	{ return m_len; }
+
+protected:
+	StorageBank* m_bank;
+	uint32_t m_crc;
+	uint32_t m_len;
+};
+
+/**
+	@brief Sink which writes data sequentially to a storage bank via a small write-block-aligned buffer
+ */
+class KVSFlashSink : public KVSByteSink
+{
+public:
+	KVSFlashSink(StorageBank* bank, uint32_t offset)
+	: m_bank(bank)
+	, m_offset(offset)
+	, m_fill(0)
+	{}
+
+	virtual bool Write(const uint8_t* data, uint32_t len)
+	{
+		while(len)
+		{
+			uint32_t chunk = KVS_STREAM_BUFFER_SIZE - m_fill;
+			if(chunk > len)
+				chunk = len;
+			memcpy(m_buf + m_fill, data, chunk);
+			m_fill += chunk;
+			data += chunk;
+			len -= chunk;
+
+			if( (m_fill == KVS_STREAM_BUFFER_SIZE) && !Flush() )
+				return false;
+		}
+		return true;
+	}
+
+	bool Flush()
+	{
+		if(m_fill == 0)
+			return true;
+		if(!m_bank->Write(m_offset, m_buf, m_fill))
+			return false;
+		m_offset += m_fill;
+		m_fill = 0;
+		return true;
+	}
+
+protected:
+	StorageBank* m_bank;
+	uint32_t m_offset;
+	uint32_t m_fill;
+	uint8_t m_buf[KVS_STREAM_BUFFER_SIZE];
+};
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Construction / destruction
@@ -82,12 +218,120 @@ KVS::KVS(StorageBank* left, StorageBank* right, uint32_t defaultLogSize)
 	, m_defaultLogSize(defaultLogSize)
 	, m_firstFreeLogEntry(0)
 	, m_firstFreeData(0)
+	, m_compactState(COMPACT_IDLE)
+	, m_compactTarget(nullptr)
+	, m_inactiveBlank(false)
+	, m_watches(nullptr)
+	, m_watchTableSize(0)
+	, m_writeCache(nullptr)
+	, m_writeCacheSize(0)
+	, m_writeCacheMaxAge(0)
+	, m_writeCacheMaxDirty(0)
+	, m_dirtyBytes(0)
+	, m_defaults(nullptr)
+	, m_defaultsSize(0)
+	, m_overridden(nullptr)
 	, m_eccFault(false)
 {
 	memset(g_blankKey, BLANK_FLASH_BYTE, KVS_NAMELEN);
 
+	#ifdef MICROKVS_CONCURRENT_READERS
+	m_snapshot = 0;
+	m_readers[0] = 0;
+	m_readers[1] = 0;
+	m_revisionWriter = false;
+	#endif
+
 	FindCurrentBank();
 	ScanCurrentBank();
+	PublishSnapshot();
+
+	//See if the inactive bank is still blank (e.g. from PrepareInactiveBank() before a reboot)
+	if(KVS_BLANK_CHECK_STRIDE != 0)
+		m_inactiveBlank = IsBankBlank(GetInactiveBank(), KVS_BLANK_CHECK_STRIDE);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Concurrency
+
+#ifdef MICROKVS_CONCURRENT_READERS
+
+/**
+	@brief Enters a read side critical section on the current active bank
+
+	@return Snapshot of the published state, to be passed to ReadUnlock()
+ */
+uint32_t KVS::ReadLock()
+{
+	while(true)
+	{
+		uint32_t snapshot = __atomic_load_n(&m_snapshot, __ATOMIC_SEQ_CST);
+		uint32_t bank = snapshot >> 31;
+		__atomic_fetch_add(&m_readers[bank], 1, __ATOMIC_SEQ_CST);
+
+		//If the bank didn't change under us, the writer is guaranteed to see our reference before erasing it.
+		//Otherwise back off and try again on the new bank.
+		if( (__atomic_load_n(&m_snapshot, __ATOMIC_SEQ_CST) >> 31) == bank)
+			return snapshot;
+		__atomic_fetch_sub(&m_readers[bank], 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/**
+	@brief Leaves a read side critical section
+ */
+void KVS::ReadUnlock(uint32_t snapshot)
+{
+	__atomic_fetch_sub(&m_readers[snapshot >> 31], 1, __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+/**
+	@brief Makes everything committed to the active bank so far visible to readers
+ */
+void KVS::PublishSnapshot()
+{
+	#ifdef MICROKVS_CONCURRENT_READERS
+		uint32_t snapshot = m_firstFreeLogEntry & 0x7fffffff;
+		if(m_active == m_right)
+			snapshot |= 0x80000000;
+		__atomic_store_n(&m_snapshot, snapshot, __ATOMIC_SEQ_CST);
+	#endif
+}
+
+/**
+	@brief Returns true if any reader is using a bank
+ */
+bool KVS::HasReaders([[maybe_unused]] StorageBank* bank)
+{
+	#ifdef MICROKVS_CONCURRENT_READERS
+		uint32_t i = (bank == m_right) ? 1 : 0;
+		return (__atomic_load_n(&m_readers[i], __ATOMIC_SEQ_CST) != 0);
+	#else
+		return false;
+	#endif
+}
+
+/**
+	@brief Blocks until no reader is using a bank, so it can be safely erased
+ */
+void KVS::WaitForReaders(StorageBank* bank)
+{
+	while(HasReaders(bank))
+	{}
+}
+
+/**
+	@brief Returns the bank a pointer (e.g. to a log entry) lies within
+ */
+StorageBank* KVS::GetBankContaining(const void* ptr)
+{
+	auto p = reinterpret_cast<const uint8_t*>(ptr);
+	auto rbase = m_right->GetBase();
+	if( (p >= rbase) && (p < rbase + m_right->GetSize()) )
+		return m_right;
+	return m_left;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -103,8 +347,15 @@ void KVS::ScanCurrentBank()
 	//(This is needed so that we can properly ignore corrupted entries)
 	auto log = m_active->GetLog();
 	auto logsize = m_active->GetHeader()->m_logSize;
-	m_firstFreeLogEntry = logsize-1;
-	LogEntry* lastlog = nullptr;
+	m_firstFreeLogEntry = logsize;
+	ClearDedupTable();
+	ClearChunkCache();
+
+	//Free data starts after the highest object in the data area.
+	//This isn't necessarily the last one in the log since deduplicated entries point back to older content.
+	//If nothing in the log, free data area starts right after the log area
+	m_firstFreeData = sizeof(BankHeader) + logsize*sizeof(LogEntry);
+
 	for(int64_t i = 0; i<logsize; i++)
 	{
 		m_eccFault = false;
@@ -112,19 +363,29 @@ void KVS::ScanCurrentBank()
 		unsafe
 		{
 			//Log entry is not blank
-			if( (log[i].m_start != BLANK_FLASH_X32) || (log[i].m_len != BLANK_FLASH_X32) )
+			if(!IsLogEntryBlank(&log[i]))
 			{
 				//Validate it, discarding anything corrupted
 				if(log[i].m_headerCRC != HeaderCRC(&log[i]))
 					continue;
 
+				//Inline objects and prefix deletes don't use the data area
+				if(log[i].m_flags & (LogEntry::FLAG_INLINE | LogEntry::FLAG_PREFIX_DELETE) )
+					continue;
+
 				//Validate object pointers
 				if(log[i].m_start + log[i].m_len >= GetBlockSize() )
 					continue;
 
-				//If it's good, save the pointer
+				//If it's good, account for the space it uses
 				if(!m_eccFault)
-					lastlog = &log[i];
+				{
+					uint32_t end = log[i].m_start + log[i].m_len;
+					if(end > m_firstFreeData)
+						m_firstFreeData = end;
+
+					AddToDedupTable(log[i].m_crc, i);
+				}
 			}
 
 			//It's blank, mark it as available
@@ -144,15 +405,10 @@ void KVS::ScanCurrentBank()
 		}
 	}
 
-	//If nothing in the log, free data area starts right after the log area
-	if(!lastlog)
-		m_firstFreeData = sizeof(BankHeader) + logsize*sizeof(LogEntry);
-
-	//If we have at least one log entry in the store, free data starts after the last log entry ends
-	else
-		m_firstFreeData = lastlog->m_start + lastlog->m_len;
+	m_firstFreeData = RoundUpToDataAlignment(m_firstFreeData);
 
-	m_firstFreeData = RoundUpToWriteBlockSize(m_firstFreeData);
+	//Objects may have been imported
+	UpdateOverrides();
 }
 
 /**
@@ -199,12 +455,47 @@ void KVS::FindCurrentBank()
 		}
 	}
 
-	//If NEITHER bank is valid, we have a blank chip.
-	//Initialize and declare the left one active.
+	//If NEITHER bank is valid, we have a blank chip, or one written in the legacy format.
 	if(!leftValid && !rightValid)
 	{
-		InitializeBank(m_left);
-		m_active = m_left;
+		//Convert the latest legacy bank into the other one
+		bool leftLegacy = false;
+		bool rightLegacy = false;
+		unsafe
+		{
+			leftLegacy = (lh->m_magic == LEGACY_HEADER_MAGIC) && (lh->m_logSize <= 0x80000000);
+			rightLegacy = (rh->m_magic == LEGACY_HEADER_MAGIC) && (rh->m_logSize <= 0x80000000);
+			if(leftLegacy && rightLegacy)
+			{
+				if(lh->m_version > rh->m_version)
+					rightLegacy = false;
+				else
+					leftLegacy = false;
+			}
+		}
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			leftLegacy = false;
+			rightLegacy = false;
+		}
+
+		if(leftLegacy || rightLegacy)
+		{
+			auto src = leftLegacy ? m_left : m_right;
+			m_active = leftLegacy ? m_right : m_left;
+			for(int i=0; i<5; i++)
+			{
+				if(MigrateLegacyBank(src, m_active))
+					return;
+			}
+			g_log(Logger::WARNING, "KVS::FindCurrentBank: could not convert legacy bank, starting empty\n");
+		}
+
+		//Otherwise initialize and declare the left one active.
+		else
+			m_active = m_left;
+		InitializeBank(m_active);
 	}
 
 	//If only one one bank is active, mark that one as active
@@ -224,12 +515,11 @@ void KVS::FindCurrentBank()
 /**
 	@brief Find the latest version of an object in the active bank, if present.
 
-	Returns NULL if no object by that name exists.
+	Returns NULL if no object by that name exists. If the object has a compiled-in default and has never been written
+	to the active bank, this is known without searching the log.
  */
 LogEntry* KVS::FindObject(const char* name)
 {
-	m_eccFault = false;
-
 	//Actual lookup key: zero padded if too short, but not guaranteed to be null terminated
 	char key[KVS_NAMELEN] = {0};
 	#pragma GCC diagnostic push
@@ -237,32 +527,119 @@ LogEntry* KVS::FindObject(const char* name)
 	strncpy(key, name, KVS_NAMELEN);
 	#pragma GCC diagnostic pop
 
-	LogEntry* log = nullptr;
+	//Objects are marked overridden before they're published, so check this after taking the snapshot
+	KVSReadLock lock(this);
+	auto def = FindDefaultIndex(name);
+	if( (def >= 0) && !IsOverridden(def) )
+		return nullptr;
 
 	//Start searching the log
-	auto len = m_active->GetHeader()->m_logSize;
-	auto base = m_active->GetLog();
-	for(uint32_t i=0; i<len; i++)
+	auto log = FindObjectInRange(lock.GetBank(), key, 0, lock.GetLogEnd(), nullptr);
+
+	//If the log entry has no data, return null
+	if(log && (log->m_len == 0))
+		return nullptr;
+
+	return log;
+}
+
+/**
+	@brief Find the latest version of an object using a handle
+
+	Only log entries written since the handle was last used are searched, unless the store has been compacted in the
+	meantime. A handle must not be used by more than one thread at a time.
+
+	Returns NULL if no object by that name exists.
+ */
+LogEntry* KVS::FindObject(KVSHandle& handle)
+{
+	KVSReadLock lock(this);
+	auto bank = lock.GetBank();
+	auto len = lock.GetLogEnd();
+
+	//If the bank has been compacted or wiped since we last looked, start over
+	uint32_t version = 0;
+	m_eccFault = false;
+	unsafe
+	{
+		version = bank->GetHeader()->m_version;
+	}
+	if(m_eccFault || (bank != handle.m_bank) || (version != handle.m_version) || (len < handle.m_logEnd) )
+	{
+		handle.m_log = nullptr;
+		handle.m_bank = bank;
+		handle.m_version = version;
+		handle.m_logEnd = 0;
+	}
+	m_eccFault = false;
+
+	//Search anything written since last time
+	if(len > handle.m_logEnd)
+	{
+		handle.m_log = FindObjectInRange(bank, handle.m_key, handle.m_logEnd, len, handle.m_log);
+		handle.m_logEnd = len;
+	}
+
+	//If the log entry has no data, return null
+	if(handle.m_log && (handle.m_log->m_len == 0))
+		return nullptr;
+
+	return handle.m_log;
+}
+
+/**
+	@brief Searches part of the log for newer versions of an object
+
+	@param bank		Bank to search
+	@param key		Key to search for (KVS_NAMELEN bytes, zero padded)
+	@param first	Index of the first log entry to search
+	@param end		Index of the log entry after the last one to search
+	@param log		Latest valid log entry for the object before "first", if any
+
+	@return Latest valid log entry for the object, including deletions, or NULL if none
+ */
+LogEntry* KVS::FindObjectInRange(StorageBank* bank, const char* key, uint32_t first, uint32_t end, LogEntry* log)
+{
+	m_eccFault = false;
+
+	auto base = bank->GetLog();
+	for(uint32_t i=first; i<end; i++)
 	{
-		//If start address is blank, this log entry was never written.
+		//If start address and length are blank, this log entry was never written.
 		//We must be at the end of the log. Whatever we've found by this point is all there is to find.
-		if(base[i].m_start == BLANK_FLASH_X32)
+		if(IsLogEntryBlank(&base[i]))
 			break;
 
 		bool crcok = false;
+		bool deleted = false;
 
 		unsafe
 		{
-			//Skip anything without the right name
-			if(memcmp(base[i].m_key, key, KVS_NAMELEN) != 0)
-				continue;
+			//A prefix delete hides every earlier object whose name starts with the prefix
+			if(base[i].m_flags & LogEntry::FLAG_PREFIX_DELETE)
+			{
+				if(!MatchesPrefixDelete(&base[i], key))
+					continue;
+				deleted = (HeaderCRC(&base[i]) == base[i].m_headerCRC);
+			}
 
-			//Check header CRC
-			if((base[i].m_headerCRC != 0) && (HeaderCRC(&base[i]) != base[i].m_headerCRC) )
+			//Segments are part of the object they were appended to, not new revisions
+			else if(base[i].m_flags & LogEntry::FLAG_SEGMENT)
 				continue;
 
-			//Check data CRC
-			crcok = (m_active->CRC(m_active->GetBase() + base[i].m_start, base[i].m_len) == base[i].m_crc);
+			else
+			{
+				//Skip anything without the right name
+				if(memcmp(base[i].m_key, key, KVS_NAMELEN) != 0)
+					continue;
+
+				//Check header CRC
+				if((base[i].m_headerCRC != 0) && (HeaderCRC(&base[i]) != base[i].m_headerCRC) )
+					continue;
+
+				//Check data CRC
+				crcok = CheckDataCRC(bank, &base[i]);
+			}
 		}
 
 		//If ECC fault, this entry is invalid
@@ -278,283 +655,3458 @@ LogEntry* KVS::FindObject(const char* name)
 		if(crcok)
 			log = &base[i];
 
+		//If deleted, there's no current version (unless there's a newer entry later on)
+		if(deleted)
+			log = nullptr;
+
 		//If CRC mismatch, entry is corrupted - fall back to the previous entry
 	}
 
-	//If the log entry has no data, return null
-	if(log && (log->m_len == 0))
-		return nullptr;
-
 	return log;
 }
 
 /**
-	@brief Calculates the expected CRC of a log entry
- */
-uint32_t KVS::HeaderCRC(const LogEntry* log)
-{
-	return m_active->CRC((const uint8_t*)log, KVS_NAMELEN + 2*sizeof(uint32_t));
-}
+	@brief Picks the hash bucket for an object name in ReadObjects()
 
-/**
-	@brief Returns a pointer to the object described by a log entry
+	Only the bytes before the first null are used, so a name and the zero padded key of its log entries hash the same.
  */
-uint8_t* KVS::MapObject(LogEntry* log)
+static uint32_t BatchBucket(const char* name)
 {
-	return m_active->GetBase() + log->m_start;
+	uint32_t hash = 0;
+	for(uint32_t i=0; (i < KVS_NAMELEN) && name[i]; i++)
+		hash = (hash * 31) + static_cast<uint8_t>(name[i]);
+	return hash % KVS_BATCH_SIZE;
 }
 
 /**
-	@brief Reads an object into a provided buffer.
-
-	If the object is more than len bytes in size, the readback is truncated but no error is returned.
-
-	@param name		Name of the object to read
-	@param data		Output buffer
-	@param len		Size of the output buffer
- */
-bool KVS::ReadObject(const char* name, uint8_t* data, uint32_t len)
-{
-	auto log = FindObject(name);
-	if(!log)
-		return false;
+	@brief Reads a batch of objects, searching the log once for all of them rather than once per object
 
-	uint32_t readlen = log->m_len;
-	if(readlen > len)
-		readlen = len;
+	Each object is read as by ReadObject(). If it doesn't exist or can't be read, its compiled-in default (if any) or
+	else m_default (if not null) is copied to the output buffer instead, but m_found is false. Up to KVS_BATCH_SIZE
+	objects are looked up in each pass over the log; objects with compiled-in defaults which have never been written,
+	and objects in the write cache, are not looked up at all.
 
-	memcpy(data, MapObject(log), readlen);
-	return true;
-}
+	Only the header of each log entry is checked during the search. The data CRC is checked once, for the latest
+	revision of each object found; if that is corrupted, the object is looked up again by itself.
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Writing
+	@param reads	Objects to read
+	@param count	Number of objects
 
-/**
-	@brief Initializes a blank bank with a header
+	@return Number of objects which were found and read
  */
-bool KVS::InitializeBank(StorageBank* bank)
+uint32_t KVS::ReadObjects(KVSBatchRead* reads, uint32_t count)
 {
-	//Erase the bank just to be safe
-	if(!bank->Erase())
-		return false;
+	KVSReadLock lock(this);
+	auto bank = lock.GetBank();
+	auto end = lock.GetLogEnd();
+	auto base = bank->GetLog();
 
-	//Write the content of the new block header
-	BankHeader header;
-	memset(&header, 0, sizeof(header));
-	header.m_magic = HEADER_MAGIC;
-	header.m_version = 0;
-	header.m_logSize = m_defaultLogSize;
-	if(bank->Write(0, (uint8_t*)&header, sizeof(header)))
-		return false;
+	uint32_t found = 0;
+	for(uint32_t first=0; first<count; first += KVS_BATCH_SIZE)
+	{
+		auto batch = reads + first;
+		uint32_t n = count - first;
+		if(n > KVS_BATCH_SIZE)
+			n = KVS_BATCH_SIZE;
 
-	return true;
-}
+		//Chain the names into hash buckets. Lists are terminated by KVS_BATCH_SIZE.
+		uint8_t buckets[KVS_BATCH_SIZE];
+		uint8_t next[KVS_BATCH_SIZE];
+		LogEntry* logs[KVS_BATCH_SIZE];
+		memset(buckets, KVS_BATCH_SIZE, sizeof(buckets));
+		for(uint32_t j=0; j<n; j++)
+		{
+			logs[j] = nullptr;
+			auto def = FindDefaultIndex(batch[j].m_name);
+			if( (def >= 0) && !IsOverridden(def) )
+				continue;
+			if(FindCachedWrite(batch[j].m_name))
+				continue;
 
-/**
-	@brief Writes a new object to the store.
+			auto bucket = BatchBucket(batch[j].m_name);
+			next[j] = buckets[bucket];
+			buckets[bucket] = j;
+		}
 
-	Any existing object by the same name is overwritten.
+		//Find the latest log entry with a good header for each name
+		m_eccFault = false;
+		for(uint32_t i=0; i<end; i++)
+		{
+			if(IsLogEntryBlank(&base[i]))
+				break;
 
-	This function will try up to five times to store the object, returning an error only if all attempts are
-	unsuccessful.
+			bool headerok = false;
+			bool prefixDelete = false;
+			uint32_t bucket = 0;
+			unsafe
+			{
+				prefixDelete = (base[i].m_flags & LogEntry::FLAG_PREFIX_DELETE) != 0;
+				if(prefixDelete)
+					headerok = (HeaderCRC(&base[i]) == base[i].m_headerCRC);
+				else if(!(base[i].m_flags & LogEntry::FLAG_SEGMENT))
+				{
+					bucket = BatchBucket(base[i].m_key);
+					if(buckets[bucket] != KVS_BATCH_SIZE)
+						headerok = (base[i].m_headerCRC == 0) || (HeaderCRC(&base[i]) == base[i].m_headerCRC);
+				}
+			}
 
-	This is	a workaround for (among others) STM32L431 errata 2.2.10.
+			if(m_eccFault)
+			{
+				m_eccFault = false;
+				g_log(Logger::WARNING, "KVS::ReadObjects: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+					m_eccFaultAddr, m_eccFaultPC);
+				continue;
+			}
+			if(!headerok)
+				continue;
 
-	@param name		Name of the object.
-					Names must be exactly KVS_NAMELEN bytes in size.
-					Shorter names are padded to KVS_NAMELEN with 0x00 bytes.
+			//The entry was read without faults above, so it's safe to look at again
+			if(prefixDelete)
+			{
+				for(uint32_t j=0; j<n; j++)
+				{
+					char key[KVS_NAMELEN] = {0};
+					#pragma GCC diagnostic push
+					#pragma GCC diagnostic ignored "-Wstringop-truncation"
+					strncpy(key, batch[j].m_name, KVS_NAMELEN);
+					#pragma GCC diagnostic pop
+					if(MatchesPrefixDelete(&base[i], key))
+						logs[j] = nullptr;
+				}
+			}
+			else
+			{
+				for(uint32_t j=buckets[bucket]; j != KVS_BATCH_SIZE; j = next[j])
+				{
+					if(strncmp(base[i].m_key, batch[j].m_name, KVS_NAMELEN) == 0)
+						logs[j] = &base[i];
+				}
+			}
+		}
+
+		//Check the data of each winner, falling back to a full search for that name if it's bad
+		for(uint32_t j=0; j<n; j++)
+		{
+			auto cached = FindCachedWrite(batch[j].m_name);
+			if(cached)
+			{
+				memcpy(batch[j].m_data, cached->m_data, (cached->m_len < batch[j].m_len) ? cached->m_len : batch[j].m_len);
+				batch[j].m_found = true;
+				found ++;
+				continue;
+			}
+
+			auto log = logs[j];
+			if(log)
+			{
+				bool crcok = false;
+				unsafe
+				{
+					crcok = CheckDataCRC(bank, log);
+				}
+				if(m_eccFault || !crcok)
+				{
+					m_eccFault = false;
+
+					char key[KVS_NAMELEN] = {0};
+					#pragma GCC diagnostic push
+					#pragma GCC diagnostic ignored "-Wstringop-truncation"
+					strncpy(key, batch[j].m_name, KVS_NAMELEN);
+					#pragma GCC diagnostic pop
+					log = FindObjectInRange(bank, key, 0, log - base, nullptr);
+				}
+			}
+
+			//Read it, or use the default if it's missing, deleted, or unreadable
+			batch[j].m_found = log && (log->m_len != 0) && ReadObject(log, batch[j].m_data, batch[j].m_len);
+			if(batch[j].m_found)
+			{
+				found ++;
+				continue;
+			}
+			auto def = GetDefault(batch[j].m_name);
+			if(def)
+				memcpy(batch[j].m_data, def->m_data, (def->m_len < batch[j].m_len) ? def->m_len : batch[j].m_len);
+			else if(batch[j].m_default)
+				memcpy(batch[j].m_data, batch[j].m_default, batch[j].m_len);
+		}
+	}
+
+	return found;
+}
+
+/**
+	@brief Calculates the expected CRC of a log entry
+ */
+uint32_t KVS::HeaderCRC(const LogEntry* log)
+{
+	return m_active->CRC((const uint8_t*)log, KVS_NAMELEN + 3*sizeof(uint32_t));
+}
+
+/**
+	@brief Checks the CRC of the content of an object
+
+	Inline objects and prefix deletes are entirely covered by the header CRC, so there's no separate data to check.
+ */
+bool KVS::CheckDataCRC(StorageBank* bank, const LogEntry* log)
+{
+	if(log->m_flags & (LogEntry::FLAG_INLINE | LogEntry::FLAG_PREFIX_DELETE) )
+		return (HeaderCRC(log) == log->m_headerCRC);
+
+	//Counter increments change after the object is written, so only the base value is covered
+	if(log->m_flags & LogEntry::FLAG_COUNTER)
+		return (bank->CRC(bank->GetBase() + log->m_start, sizeof(uint32_t)) == log->m_crc);
+
+	//Chunked objects only have their chunk CRCs checked here. The chunks themselves are checked as they're read.
+	if(log->m_flags & LogEntry::FLAG_CHUNKED)
+	{
+		if(log->m_len < sizeof(uint32_t))
+			return false;
+		auto p = bank->GetBase() + log->m_start;
+		uint32_t size;
+		memcpy(&size, p + log->m_len - sizeof(uint32_t), sizeof(size));
+		if( (size > log->m_len) || (log->m_len - size != CHUNK_TABLE_SIZE(size)) )
+			return false;
+		return (bank->CRC(p + size, log->m_len - size) == log->m_crc);
+	}
+
+	//Rewritable objects are checked against the CRC slot for the latest in-place update. If writing that slot was
+	//interrupted, the content was never changed and still matches the previous one.
+	if(log->m_flags & LogEntry::FLAG_REWRITABLE)
+	{
+		if(log->m_len < REWRITE_SLOTS_SIZE)
+			return false;
+		uint32_t len = log->m_len - REWRITE_SLOTS_SIZE;
+		auto p = bank->GetBase() + log->m_start;
+
+		uint32_t expected = log->m_crc;
+		uint32_t previous = log->m_crc;
+		for(uint32_t i=0; i<KVS_REWRITE_SLOTS; i++)
+		{
+			uint32_t slot;
+			memcpy(&slot, p + len + i*sizeof(uint32_t), sizeof(slot));
+			if(slot == BLANK_FLASH_X32)
+				break;
+			previous = expected;
+			expected = slot;
+		}
+
+		uint32_t crc = bank->CRC(p, len);
+		return (crc == expected) || (crc == previous);
+	}
+
+	return (bank->CRC(bank->GetBase() + log->m_start, log->m_len) == log->m_crc);
+}
+
+/**
+	@brief Returns a pointer to the object described by a log entry
+
+	Compressed objects, counters, and deltas cannot be memory mapped; NULL is returned for them. Use ReadObject()
+	instead.
+
+	Only the first segment of an appendable object is mapped. Use GetNextSegment() to find the rest.
+
+	The content of chunked objects is not checked before it's mapped. Use VerifyObjectRange() first, or read it with
+	ReadObjectRange().
+ */
+uint8_t* KVS::MapObject(LogEntry* log)
+{
+	if(log->m_flags & (LogEntry::FLAG_COMPRESSED | LogEntry::FLAG_COUNTER | LogEntry::FLAG_DELTA) )
+		return nullptr;
+
+	//Inline content is in the log entry itself
+	if(log->m_flags & LogEntry::FLAG_INLINE)
+		return reinterpret_cast<uint8_t*>(&log->m_start);
+
+	return GetBankContaining(log)->GetBase() + log->m_start;
+}
+
+/**
+	@brief Returns the size of the object described by a log entry, as seen by ReadObject()
+
+	This differs from log->m_len (the number of bytes occupied in flash) for compressed, counter, rewritable,
+	appendable, delta, and chunked objects.
+ */
+uint32_t KVS::GetObjectSize(LogEntry* log)
+{
+	if(log->m_flags & LogEntry::FLAG_COUNTER)
+		return sizeof(uint32_t);
+	if(log->m_flags & LogEntry::FLAG_APPENDABLE)
+	{
+		uint32_t size = log->m_len;
+		for(auto seg = GetNextSegment(log); seg; seg = GetNextSegment(seg))
+			size += seg->m_len;
+		return size;
+	}
+	if(log->m_flags & LogEntry::FLAG_REWRITABLE)
+		return log->m_len - REWRITE_SLOTS_SIZE;
+	if(log->m_flags & LogEntry::FLAG_CHUNKED)
+	{
+		uint32_t size = 0;
+		unsafe
+		{
+			memcpy(&size, GetBankContaining(log)->GetBase() + log->m_start + log->m_len - sizeof(uint32_t), sizeof(size));
+		}
+		return size;
+	}
+	if(log->m_flags & LogEntry::FLAG_DELTA)
+	{
+		KVSDeltaHeader header = {0, 0};
+		unsafe
+		{
+			memcpy(&header, GetBankContaining(log)->GetBase() + log->m_start, sizeof(header));
+		}
+		return header.m_size;
+	}
+	if(log->m_flags & LogEntry::FLAG_COMPRESSED)
+	{
+		uint32_t size = 0;
+		unsafe
+		{
+			size = LZCodec::GetDecompressedLength(GetBankContaining(log)->GetBase() + log->m_start, log->m_len);
+		}
+		return size;
+	}
+	return log->m_len;
+}
+
+/**
+	@brief Reads an object into a provided buffer.
+
+	If the object is more than len bytes in size, the readback is truncated but no error is returned.
+
+	If the object doesn't exist but has a compiled-in default, the default is read instead. Content written by
+	StoreObjectDeferred() is read from the write cache until it's flushed.
+
+	@param name		Name of the object to read
+	@param data		Output buffer
+	@param len		Size of the output buffer
+ */
+bool KVS::ReadObject(const char* name, uint8_t* data, uint32_t len)
+{
+	auto cached = FindCachedWrite(name);
+	if(cached)
+	{
+		memcpy(data, cached->m_data, (cached->m_len < len) ? cached->m_len : len);
+		return true;
+	}
+
+	KVSReadLock lock(this);
+	auto log = FindObject(name);
+	if(!log)
+	{
+		auto def = GetDefault(name);
+		if(!def)
+			return false;
+		memcpy(data, def->m_data, (def->m_len < len) ? def->m_len : len);
+		return true;
+	}
+
+	return ReadObject(log, data, len);
+}
+
+/**
+	@brief Reads an object into a provided buffer, using a handle to find it.
+
+	If the object is more than len bytes in size, the readback is truncated but no error is returned.
+
+	If the object doesn't exist but has a compiled-in default, the default is read instead. Content written by
+	StoreObjectDeferred() is read from the write cache until it's flushed.
+
+	@param handle	Handle for the object
+	@param data		Output buffer
+	@param len		Size of the output buffer
+ */
+bool KVS::ReadObject(KVSHandle& handle, uint8_t* data, uint32_t len)
+{
+	auto cached = FindCachedWrite(handle.GetName());
+	if(cached)
+	{
+		memcpy(data, cached->m_data, (cached->m_len < len) ? cached->m_len : len);
+		return true;
+	}
+
+	KVSReadLock lock(this);
+	auto log = FindObject(handle);
+	if(!log)
+	{
+		auto def = GetDefault(handle.GetName());
+		if(!def)
+			return false;
+		memcpy(data, def->m_data, (def->m_len < len) ? def->m_len : len);
+		return true;
+	}
+
+	return ReadObject(log, data, len);
+}
+
+/**
+	@brief Reads the object described by a log entry into a provided buffer, decompressing if necessary.
+
+	If the object is more than len bytes in size, the readback is truncated but no error is returned.
+
+	@param log		Log entry for the object, as returned by FindObject()
+	@param data		Output buffer
+	@param len		Size of the output buffer
+ */
+bool KVS::ReadObject(LogEntry* log, uint8_t* data, uint32_t len)
+{
+	//Counters read as a uint32_t
+	if(log->m_flags & LogEntry::FLAG_COUNTER)
+	{
+		m_eccFault = false;
+		uint32_t value = GetCounterValue(GetBankContaining(log), log);
+		if(len > sizeof(value))
+			len = sizeof(value);
+		memcpy(data, &value, len);
+		return !m_eccFault;
+	}
+
+	if(log->m_flags & LogEntry::FLAG_COMPRESSED)
+	{
+		auto src = GetBankContaining(log)->GetBase() + log->m_start;
+		uint32_t readlen = GetObjectSize(log);
+		if(readlen > len)
+			readlen = len;
+
+		m_eccFault = false;
+		uint32_t outlen = 0;
+		unsafe
+		{
+			outlen = LZCodec::Decompress(src, log->m_len, data, readlen);
+		}
+		return !m_eccFault && (outlen == readlen);
+	}
+
+	//Chunked objects are checked a chunk at a time as they're read
+	if(log->m_flags & LogEntry::FLAG_CHUNKED)
+	{
+		uint32_t readlen = GetObjectSize(log);
+		if(readlen > len)
+			readlen = len;
+
+		return ReadObjectRange(log, 0, data, readlen);
+	}
+
+	//Deltas are rebuilt from the revisions they apply to
+	if(log->m_flags & LogEntry::FLAG_DELTA)
+	{
+		uint32_t readlen = GetObjectSize(log);
+		if(readlen > len)
+			readlen = len;
+
+		return ReadRange(GetBankContaining(log), log, 0, data, readlen);
+	}
+
+	//Appendable objects are read one segment at a time
+	if(log->m_flags & LogEntry::FLAG_APPENDABLE)
+	{
+		uint32_t off = 0;
+		for(auto seg = log; seg && (off < len); seg = GetNextSegment(seg))
+		{
+			uint32_t readlen = seg->m_len;
+			if(readlen > len - off)
+				readlen = len - off;
+
+			memcpy(data + off, MapObject(seg), readlen);
+			off += readlen;
+		}
+		return true;
+	}
+
+	uint32_t readlen = GetObjectSize(log);
+	if(readlen > len)
+		readlen = len;
+
+	memcpy(data, MapObject(log), readlen);
+	return true;
+}
+
+/**
+	@brief Reads part of an object into a provided buffer
+
+	@param name		Name of the object to read
+	@param offset	Offset within the object of the first byte to read
+	@param data		Output buffer
+	@param len		Number of bytes to read
+
+	@return False if the object doesn't exist or couldn't be read (see the LogEntry version)
+ */
+bool KVS::ReadObjectRange(const char* name, uint32_t offset, uint8_t* data, uint32_t len)
+{
+	KVSReadLock lock(this);
+	auto log = FindObject(name);
+	if(!log)
+		return false;
+
+	return ReadObjectRange(log, offset, data, len);
+}
+
+/**
+	@brief Reads part of the object described by a log entry into a provided buffer
+
+	Only the chunks of a chunked object which the range touches are checked, so slices of a large object can be read
+	quickly (e.g. in an interrupt handler). Compressed objects, counters, and appendable objects can't be read this way.
+
+	@param log		Log entry for the object, as returned by FindObject()
+	@param offset	Offset within the object of the first byte to read
+	@param data		Output buffer
+	@param len		Number of bytes to read
+
+	@return False if the range is out of bounds, the content is corrupted, or the object can't be read in ranges
+ */
+bool KVS::ReadObjectRange(LogEntry* log, uint32_t offset, uint8_t* data, uint32_t len)
+{
+	if(!VerifyObjectRange(log, offset, len))
+		return false;
+
+	if(log->m_flags & LogEntry::FLAG_DELTA)
+		return ReadRange(GetBankContaining(log), log, offset, data, len);
+
+	auto p = (log->m_flags & LogEntry::FLAG_APPENDABLE) ? nullptr : MapObject(log);
+	if(!p)
+		return false;
+
+	m_eccFault = false;
+	unsafe
+	{
+		memcpy(data, p + offset, len);
+	}
+	if(m_eccFault)
+	{
+		m_eccFault = false;
+		g_log(Logger::WARNING, "KVS::ReadObjectRange: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+			m_eccFaultAddr, m_eccFaultPC);
+		return false;
+	}
+	return true;
+}
+
+/**
+	@brief Checks that part of an object is intact
+
+	Chunked objects have the CRC of each chunk touched by the range checked (unless it was checked recently). The
+	content of any other kind of object was already checked when it was found, so only the bounds are checked.
+
+	@return False if the range is out of bounds or the content is corrupted
+ */
+bool KVS::VerifyObjectRange(LogEntry* log, uint32_t offset, uint32_t len)
+{
+	uint32_t size = GetObjectSize(log);
+	if( (offset > size) || (len > size - offset) )
+		return false;
+	if( !(log->m_flags & LogEntry::FLAG_CHUNKED) || (len == 0) )
+		return true;
+
+	auto bank = GetBankContaining(log);
+	auto p = bank->GetBase() + log->m_start;
+	auto cache = GetChunkCache(log);
+	for(uint32_t i = offset / KVS_CHUNK_SIZE; i <= (offset + len - 1) / KVS_CHUNK_SIZE; i++)
+	{
+		bool cacheable = cache && (i < KVS_CHUNK_CACHE_CHUNKS);
+		if(cacheable && (cache[i / 32] & (1u << (i % 32))) )
+			continue;
+
+		uint32_t start = i * KVS_CHUNK_SIZE;
+		uint32_t chunk = size - start;
+		if(chunk > KVS_CHUNK_SIZE)
+			chunk = KVS_CHUNK_SIZE;
+
+		m_eccFault = false;
+		bool ok = false;
+		unsafe
+		{
+			uint32_t expected;
+			memcpy(&expected, p + size + i*sizeof(uint32_t), sizeof(expected));
+			ok = (bank->CRC(p + start, chunk) == expected);
+		}
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::VerifyObjectRange: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			return false;
+		}
+		if(!ok)
+			return false;
+
+		if(cacheable)
+			cache[i / 32] |= (1u << (i % 32));
+	}
+
+	return true;
+}
+
+/**
+	@brief Forgets which chunks of chunked objects have been checked
+
+	Must be called before erasing a bank, since its log entries (which identify cache entries) will be reused.
+ */
+void KVS::ClearChunkCache()
+{
+	#if KVS_CHUNK_CACHE_SIZE > 0
+		memset(m_chunkCache, 0, sizeof(m_chunkCache));
+		m_nextChunkCache = 0;
+	#endif
+}
+
+/**
+	@brief Returns the bitmap of checked chunks for a chunked object, replacing the oldest cache entry if it isn't
+	already in the cache
+
+	@return The bitmap, or NULL if the cache is disabled
+ */
+uint32_t* KVS::GetChunkCache([[maybe_unused]] const LogEntry* log)
+{
+	#if KVS_CHUNK_CACHE_SIZE > 0
+		for(uint32_t i=0; i<KVS_CHUNK_CACHE_SIZE; i++)
+		{
+			if(m_chunkCache[i].m_log == log)
+				return m_chunkCache[i].m_verified;
+		}
+
+		auto& entry = m_chunkCache[m_nextChunkCache];
+		m_nextChunkCache = (m_nextChunkCache + 1) % KVS_CHUNK_CACHE_SIZE;
+		entry.m_log = log;
+		memset(entry.m_verified, 0, sizeof(entry.m_verified));
+		return entry.m_verified;
+	#else
+		return nullptr;
+	#endif
+}
+
+/**
+	@brief Reads part of a plain or delta revision of an object
+
+	@param bank		Bank containing the revision
+	@param log		Log entry for the revision
+	@param offset	Offset within the object of the first byte to read
+	@param data		Output buffer
+	@param len		Number of bytes to read
+
+	@return False if the range is out of bounds, the chain of deltas is broken, or an ECC error occurred
+ */
+bool KVS::ReadRange(StorageBank* bank, LogEntry* log, uint32_t offset, uint8_t* data, uint32_t len)
+{
+	auto p = bank->GetBase() + log->m_start;
+
+	//Plain objects are just copied
+	if(!(log->m_flags & LogEntry::FLAG_DELTA))
+	{
+		if( (offset > log->m_len) || (len > log->m_len - offset) )
+			return false;
+
+		m_eccFault = false;
+		unsafe
+		{
+			memcpy(data, p + offset, len);
+		}
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::ReadObject: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			return false;
+		}
+		return true;
+	}
+
+	//Start with the same range of the revision this one applies to
+	auto base = FindDeltaBase(bank, log - bank->GetLog(), log->m_key);
+	if(!base || !ReadRange(bank, base, offset, data, len))
+		return false;
+
+	//Then overlay the ranges changed by this revision
+	m_eccFault = false;
+	bool ok = true;
+	unsafe
+	{
+		KVSDeltaHeader header;
+		memcpy(&header, p, sizeof(header));
+		if( (offset > header.m_size) || (len > header.m_size - offset) )
+			ok = false;
+
+		uint32_t pos = sizeof(header);
+		while(ok && (pos + sizeof(KVSDeltaRange) <= log->m_len) )
+		{
+			KVSDeltaRange range;
+			memcpy(&range, p + pos, sizeof(range));
+			pos += sizeof(range);
+			if( (range.m_len > log->m_len - pos) || (range.m_offset > header.m_size - range.m_len) )
+			{
+				ok = false;
+				break;
+			}
+
+			uint32_t first = (range.m_offset > offset) ? range.m_offset : offset;
+			uint32_t last = range.m_offset + range.m_len;
+			if(last > offset + len)
+				last = offset + len;
+			if(first < last)
+				memcpy(data + first - offset, p + pos + first - range.m_offset, last - first);
+
+			pos += range.m_len;
+		}
+	}
+	if(m_eccFault)
+	{
+		m_eccFault = false;
+		g_log(Logger::WARNING, "KVS::ReadObject: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+			m_eccFaultAddr, m_eccFaultPC);
+		return false;
+	}
+
+	return ok;
+}
+
+/**
+	@brief Finds the revision a delta applies to
+
+	This is the latest entry with the given key before the delta. It must be a valid plain or delta revision, otherwise
+	the delta can't be applied (and there's no way to work out its content).
+
+	@param bank		Bank to search
+	@param index	Index of the log entry for the delta (or the first free entry, to find what a new delta would apply to)
+	@param key		Key of the object (KVS_NAMELEN bytes, zero padded)
+
+	@return The base revision, or NULL if there's no usable one
+ */
+LogEntry* KVS::FindDeltaBase(StorageBank* bank, uint32_t index, const char* key)
+{
+	auto base = bank->GetLog();
+	for(uint32_t i=index; i>0; i--)
+	{
+		auto log = &base[i-1];
+
+		m_eccFault = false;
+		bool valid = false;
+		unsafe
+		{
+			//The object was deleted in between
+			if(log->m_flags & LogEntry::FLAG_PREFIX_DELETE)
+			{
+				if(MatchesPrefixDelete(log, key) && (HeaderCRC(log) == log->m_headerCRC) )
+					return nullptr;
+				continue;
+			}
+
+			if(log->m_flags & LogEntry::FLAG_SEGMENT)
+				continue;
+			if(memcmp(log->m_key, key, KVS_NAMELEN) != 0)
+				continue;
+
+			valid =
+				( (log->m_flags == 0) || (log->m_flags == LogEntry::FLAG_DELTA) ) &&
+				(log->m_len != 0) &&
+				(HeaderCRC(log) == log->m_headerCRC) &&
+				CheckDataCRC(bank, log);
+		}
+
+		//Can't tell if this was the base or not, so give up
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::FindDeltaBase: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			return nullptr;
+		}
+
+		return valid ? log : nullptr;
+	}
+
+	return nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Writing
+
+/**
+	@brief Initializes a blank bank with a header
+ */
+bool KVS::InitializeBank(StorageBank* bank)
+{
+	//Erase the bank just to be safe
+	ClearChunkCache();
+	if(!bank->Erase())
+		return false;
+
+	//Write the content of the new block header
+	BankHeader header;
+	memset(&header, 0, sizeof(header));
+	header.m_magic = HEADER_MAGIC;
+	header.m_version = 0;
+	header.m_logSize = m_defaultLogSize;
+	if(bank->Write(0, (uint8_t*)&header, sizeof(header)))
+		return false;
+
+	return true;
+}
+
+/**
+	@brief Copies the latest revision of every object in a bank written in the legacy format (LEGACY_HEADER_MAGIC)
+	into a bank in the current format
+
+	The legacy bank is left untouched, and the new one only becomes valid once everything has been copied, so this is
+	safe to interrupt; it will simply be done again at the next startup.
+
+	@param src		Bank in the legacy format
+	@param dst		Bank to convert it into, which must be m_active
+
+	@return True if the new bank was written successfully
+ */
+bool KVS::MigrateLegacyBank(StorageBank* src, StorageBank* dst)
+{
+	ClearChunkCache();
+	if(!dst->Erase())
+		return false;
+
+	uint32_t logSize = 0;
+	uint32_t version = 0;
+	m_eccFault = false;
+	unsafe
+	{
+		logSize = src->GetHeader()->m_logSize;
+		version = src->GetHeader()->m_version;
+	}
+	if(m_eccFault)
+	{
+		m_eccFault = false;
+		return false;
+	}
+
+	auto log = reinterpret_cast<const LegacyLogEntry*>(src->GetBase() + sizeof(BankHeader));
+	uint32_t end = 0;
+	unsafe
+	{
+		while( (end < logSize) && ( (log[end].m_start != BLANK_FLASH_X32) || (log[end].m_len != BLANK_FLASH_X32) ) )
+			end ++;
+	}
+	m_eccFault = false;
+
+	uint32_t nextLog = 0;
+	uint32_t nextData = RoundUpToDataAlignment(sizeof(BankHeader) + m_defaultLogSize*sizeof(LogEntry));
+	for(uint32_t i=0; i<end; i++)
+	{
+		bool valid = false;
+		bool superseded = false;
+		unsafe
+		{
+			//Same checks as the legacy code made when looking up an object
+			auto isValid = [&](const LegacyLogEntry& e)
+			{
+				auto headerCRC = src->CRC((const uint8_t*)&e, KVS_NAMELEN + 2*sizeof(uint32_t));
+				if( (e.m_headerCRC != 0) && (headerCRC != e.m_headerCRC) )
+					return false;
+				if( (e.m_start > GetBlockSize()) || (e.m_len > GetBlockSize() - e.m_start) )
+					return false;
+				return src->CRC(src->GetBase() + e.m_start, e.m_len) == e.m_crc;
+			};
+
+			valid = isValid(log[i]);
+			for(uint32_t j=i+1; valid && (j<end) && !superseded; j++)
+			{
+				if(memcmp(log[j].m_key, log[i].m_key, KVS_NAMELEN) == 0)
+					superseded = isValid(log[j]);
+			}
+		}
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::MigrateLegacyBank: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			continue;
+		}
+
+		//Skip older revisions, deletions, and anything corrupted
+		if(!valid || superseded || (log[i].m_len == 0) )
+			continue;
+
+		if( (nextLog >= m_defaultLogSize) || (nextData + log[i].m_len > GetBlockSize()) )
+			return false;
+		if(!dst->Copy(src, log[i].m_start, nextData, log[i].m_len))
+			return false;
+
+		LogEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		memcpy(entry.m_key, log[i].m_key, KVS_NAMELEN);
+		entry.m_start = nextData;
+		entry.m_len = log[i].m_len;
+		entry.m_flags = 0;
+		entry.m_crc = log[i].m_crc;
+		entry.m_headerCRC = HeaderCRC(&entry);
+		if(!dst->Write(sizeof(BankHeader) + nextLog*sizeof(LogEntry), (uint8_t*)&entry, sizeof(entry)))
+			return false;
+
+		nextLog ++;
+		nextData = RoundUpToDataAlignment(nextData + log[i].m_len);
+	}
+
+	//Write the header last, making the new bank valid
+	BankHeader bh;
+	memset(&bh, 0, sizeof(bh));
+	bh.m_magic = HEADER_MAGIC;
+	bh.m_version = version + 1;
+	bh.m_logSize = m_defaultLogSize;
+	if(!dst->Write(0, (uint8_t*)&bh, sizeof(bh)))
+		return false;
+
+	return true;
+}
+
+/**
+	@brief Writes a new object to the store.
+
+	Any existing object by the same name is overwritten.
+
+	This function will try up to five times to store the object, returning an error only if all attempts are
+	unsuccessful.
+
+	This is	a workaround for (among others) STM32L431 errata 2.2.10.
+
+	@param name		Name of the object.
+					Names must be exactly KVS_NAMELEN bytes in size.
+					Shorter names are padded to KVS_NAMELEN with 0x00 bytes.
 					Longer names are truncated.
 					The names 0x00..00 0xFF...FF are reserved and may not be used for an object.
 	@param data		Object content
 	@param len		Length of the object
  */
-bool KVS::StoreObject(const char* name, const uint8_t* data, uint32_t len)
+bool KVS::StoreObject(const char* name, const uint8_t* data, uint32_t len)
+{
+	for(int i=0; i<5; i++)
+	{
+		if(StoreObjectInternal(name, data, len))
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Writes a new object to the store, using a handle for the name.
+
+	The handle picks up the new version the next time it is used.
+ */
+bool KVS::StoreObject(KVSHandle& handle, const uint8_t* data, uint32_t len)
+{
+	return StoreObject(handle.m_key, data, len);
+}
+
+/**
+	@brief Writes a new object to the store, compressing it.
+
+	Compressed objects take up less flash space but cannot be accessed with MapObject(), and must be read with
+	ReadObject(). If the content doesn't compress it is stored uncompressed.
+
+	The compressed stream is generated twice (once to measure it, once to write it) so no RAM buffer for the
+	compressed data is required.
+
+	@param name		Name of the object (see StoreObject)
+	@param data		Object content
+	@param len		Length of the object
+ */
+bool KVS::StoreCompressedObject(const char* name, const uint8_t* data, uint32_t len)
+{
+	for(int i=0; i<5; i++)
+	{
+		if(StoreObjectInternal(name, data, len, LogEntry::FLAG_COMPRESSED))
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Writes a new revision of an object, storing only the byte ranges which changed if that saves space
+
+	Intended for large structures (calibration tables, etc.) which are rewritten with only a few fields changed. If
+	the current revision of the object is a plain (or delta) revision of the same length, the changed ranges are stored
+	as a delta which refers to it, as long as the delta is no more than half the size of the object. Otherwise, or once
+	KVS_DELTA_CHAIN_MAX deltas are chained, a full copy is written as by StoreObject().
+
+	Deltas cannot be accessed with MapObject() and must be read with ReadObject(), which rebuilds the object from the
+	chain. Compaction folds the chain back into a full copy.
+
+	@param name		Name of the object (see StoreObject)
+	@param data		Object content
+	@param len		Length of the object
+ */
+bool KVS::StoreDeltaObject(const char* name, const uint8_t* data, uint32_t len)
+{
+	for(int i=0; i<5; i++)
+	{
+		if(StoreObjectInternal(name, data, len, LogEntry::FLAG_DELTA))
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Writes one changed range of a delta, from "first" to "last" inclusive
+ */
+static bool WriteDeltaRange(KVSByteSink* sink, const uint8_t* data, uint32_t first, uint32_t last)
+{
+	KVSDeltaRange range;
+	range.m_offset = first;
+	range.m_len = last + 1 - first;
+	if(!sink->Write(reinterpret_cast<uint8_t*>(&range), sizeof(range)))
+		return false;
+	return sink->Write(data + first, range.m_len);
+}
+
+/**
+	@brief Generates a delta from a revision of an object to new content
+
+	The content of the base is read a chunk at a time, so only a small buffer is needed. Changed ranges separated by
+	fewer unchanged bytes than a range header are merged.
+
+	@param base		Revision the delta applies to, from FindDeltaBase()
+	@param data		New content
+	@param len		Length of the new content, which must be the same as that of the base
+	@param sink		Destination for the delta
+
+	@return False if the base couldn't be read or the sink reported an error
+ */
+bool KVS::EncodeDelta(LogEntry* base, const uint8_t* data, uint32_t len, KVSByteSink* sink)
+{
+	auto bank = GetBankContaining(base);
+
+	KVSDeltaHeader header;
+	header.m_size = len;
+	header.m_depth = 1;
+	if(base->m_flags & LogEntry::FLAG_DELTA)
+	{
+		KVSDeltaHeader prev = {0, 0};
+		m_eccFault = false;
+		unsafe
+		{
+			memcpy(&prev, bank->GetBase() + base->m_start, sizeof(prev));
+		}
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			return false;
+		}
+		header.m_depth = prev.m_depth + 1;
+	}
+	if(!sink->Write(reinterpret_cast<uint8_t*>(&header), sizeof(header)))
+		return false;
+
+	uint8_t buf[KVS_STREAM_BUFFER_SIZE];
+	bool inRange = false;
+	uint32_t first = 0;
+	uint32_t last = 0;
+	for(uint32_t off=0; off<len; off += KVS_STREAM_BUFFER_SIZE)
+	{
+		uint32_t chunk = len - off;
+		if(chunk > KVS_STREAM_BUFFER_SIZE)
+			chunk = KVS_STREAM_BUFFER_SIZE;
+		if(!ReadRange(bank, base, off, buf, chunk))
+			return false;
+
+		for(uint32_t i=0; i<chunk; i++)
+		{
+			uint32_t pos = off + i;
+			if(buf[i] != data[pos])
+			{
+				if(!inRange)
+					first = pos;
+				inRange = true;
+				last = pos;
+			}
+
+			//Close the range once enough unchanged bytes follow it
+			else if(inRange && (pos - last > sizeof(KVSDeltaRange)) )
+			{
+				if(!WriteDeltaRange(sink, data, first, last))
+					return false;
+				inRange = false;
+			}
+		}
+	}
+
+	if(inRange)
+		return WriteDeltaRange(sink, data, first, last);
+	return true;
+}
+
+/**
+	@brief Writes a new revision of an object with part of its content replaced
+
+	The unchanged content is copied from the current revision a chunk at a time while the new revision is written, so
+	only the replaced bytes need to be in RAM. The patch may extend the object past its current end, but can't start
+	after it. The new revision is a plain object.
+
+	Compressed, appendable and chunked objects larger than KVS_STREAM_BUFFER_SIZE can't be patched.
+
+	@param name		Name of the object (see StoreObject)
+	@param offset	Offset of the first byte to replace
+	@param data		New content
+	@param len		Number of bytes to replace
+
+	@return False if the object doesn't exist, the offset is past its end, or the new revision couldn't be written
+ */
+bool KVS::PatchObject(const char* name, uint32_t offset, const uint8_t* data, uint32_t len)
+{
+	//Patch the latest content, not what's in flash
+	if(FindCachedWrite(name) && !Flush())
+		return false;
+
+	for(int i=0; i<5; i++)
+	{
+		//Look up the object on every attempt, since a failed attempt may have compacted the store
+		if(!FinishCompact())
+			return false;
+		auto log = FindObject(name);
+		if(!log)
+			return false;
+
+		KVSPatch patch;
+		patch.m_base = log;
+		patch.m_offset = offset;
+		patch.m_size = GetObjectSize(log);
+		if(offset > patch.m_size)
+			return false;
+		if(offset + len > patch.m_size)
+			patch.m_size = offset + len;
+
+		//Small objects of any kind are simply patched in RAM
+		if(patch.m_size <= KVS_STREAM_BUFFER_SIZE)
+		{
+			uint8_t buf[KVS_STREAM_BUFFER_SIZE];
+			if(!ReadObject(log, buf, sizeof(buf)))
+				continue;
+			memcpy(buf + offset, data, len);
+			if(StoreObjectInternal(name, buf, patch.m_size))
+				return true;
+			continue;
+		}
+
+		if(log->m_flags & ~(LogEntry::FLAG_DELTA | LogEntry::FLAG_REWRITABLE))
+			return false;
+		if(StoreObjectInternal(name, data, len, 0, &patch))
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Generates the content of a patched revision (see PatchObject)
+
+	@param patch	Description of the new revision
+	@param data		Bytes replaced by the patch
+	@param len		Number of bytes replaced
+	@param sink		Destination for the content
+	@param first	Offset to start generating from (must not be inside the patch)
+
+	@return False if the base revision couldn't be read or the sink reported an error
+ */
+bool KVS::GeneratePatch(const KVSPatch* patch, const uint8_t* data, uint32_t len, KVSByteSink* sink, uint32_t first)
+{
+	auto bank = GetBankContaining(patch->m_base);
+	uint8_t buf[KVS_STREAM_BUFFER_SIZE];
+
+	//Unchanged content before and after the patch is copied from the base
+	for(uint32_t off=first; off<patch->m_size; )
+	{
+		if(off == patch->m_offset)
+		{
+			if(!sink->Write(data, len))
+				return false;
+			off += len;
+			continue;
+		}
+
+		uint32_t end = (off < patch->m_offset) ? patch->m_offset : patch->m_size;
+		uint32_t chunk = end - off;
+		if(chunk > KVS_STREAM_BUFFER_SIZE)
+			chunk = KVS_STREAM_BUFFER_SIZE;
+		if(!ReadRange(bank, patch->m_base, off, buf, chunk))
+			return false;
+		if(!sink->Write(buf, chunk))
+			return false;
+		off += chunk;
+	}
+
+	return true;
+}
+
+/**
+	@brief Writes an object with a separate CRC for each KVS_CHUNK_SIZE byte chunk of its content
+
+	Intended for large objects (lookup tables, etc.) which are read a slice at a time. ReadObjectRange() and
+	VerifyObjectRange() only check the chunks a range touches, and remember which chunks they've checked, rather than
+	the whole object being checked every time it's found. The chunk CRCs cost 4 bytes of data space per chunk.
+
+	@param name		Name of the object (see StoreObject)
+	@param data		Object content
+	@param len		Length of the object
+ */
+bool KVS::StoreChunkedObject(const char* name, const uint8_t* data, uint32_t len)
+{
+	for(int i=0; i<5; i++)
+	{
+		if(StoreObjectInternal(name, data, len, LogEntry::FLAG_CHUNKED))
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Writes the chunk CRCs and length which follow the content of a chunked object
+ */
+static bool WriteChunkTable(StorageBank* bank, const uint8_t* data, uint32_t len, KVSByteSink* sink)
+{
+	for(uint32_t off=0; off<len; off += KVS_CHUNK_SIZE)
+	{
+		uint32_t chunk = len - off;
+		if(chunk > KVS_CHUNK_SIZE)
+			chunk = KVS_CHUNK_SIZE;
+
+		uint32_t crc = bank->CRC(data + off, chunk);
+		if(!sink->Write(reinterpret_cast<uint8_t*>(&crc), sizeof(crc)))
+			return false;
+	}
+	return sink->Write(reinterpret_cast<const uint8_t*>(&len), sizeof(len));
+}
+
+/**
+	@brief Writes an object which can later be updated in place, if the new content only programs more bits
+
+	Flag words, bitmasks, and similar values which evolve monotonically can then be updated without using another
+	log entry or any more data space. If the current version of the object was also written by this function, has the
+	same length, and the new content only changes bits which are still blank, the new content is programmed over the
+	old and its CRC written to the next free CRC slot. Otherwise (or once the slots are used up) a new revision is
+	written, with KVS_REWRITE_SLOTS slots reserved after it.
+
+	Only the changed bytes are programmed, after the CRC slot. If this is interrupted by a power failure the object may
+	be left corrupted, and reads fall back to its previous revision in the log. So that there always is one, the object
+	is only updated in place if an older revision of it is still in the active bank; otherwise a new revision is
+	written.
+
+	In-place updates add no log entry, so they are not reported by GetNextChange() and don't change the revision
+	returned by GetRevision(). StoreObjectIfRevision() therefore refuses to overwrite a rewritable object. Watches are
+	notified.
+
+	Flash with a write block size cannot program the same block twice, so on those parts (MICROKVS_WRITE_BLOCK_SIZE
+	defined) this is the same as StoreObject(). It is also the same with MICROKVS_CONCURRENT_READERS, since a reader
+	could see the content part way through being updated.
+
+	@param name		Name of the object (see StoreObject)
+	@param data		Object content
+	@param len		Length of the object
+ */
+bool KVS::StoreRewritableObject(const char* name, const uint8_t* data, uint32_t len)
+{
+	#if defined(MICROKVS_WRITE_BLOCK_SIZE) || defined(MICROKVS_CONCURRENT_READERS)
+		return StoreObject(name, data, len);
+	#else
+
+		//Can't write to the active bank while it's being copied
+		if(!FinishCompact())
+			return false;
+
+		//Only update in place if there's an older revision to fall back to if the update is interrupted
+		auto log = FindObject(name);
+		LogEntry* previous = nullptr;
+		if(log && (log->m_flags & LogEntry::FLAG_REWRITABLE) && (GetObjectSize(log) == len) )
+			previous = FindObjectInRange(m_active, log->m_key, 0, log - m_active->GetLog(), nullptr);
+		if(previous && (previous->m_len != 0) && RewriteInPlace(log, data, len) )
+			return true;
+
+		for(int i=0; i<5; i++)
+		{
+			if(StoreObjectInternal(name, data, len, LogEntry::FLAG_REWRITABLE))
+				return true;
+		}
+		return false;
+
+	#endif
+}
+
+/**
+	@brief Updates the content of a rewritable object in place, if possible
+
+	@return False if the content can't be updated in place, and a new revision must be written
+ */
+bool KVS::RewriteInPlace(LogEntry* log, const uint8_t* data, uint32_t len)
+{
+	auto p = m_active->GetBase() + log->m_start;
+
+	m_eccFault = false;
+	uint32_t first = len;
+	uint32_t last = 0;
+	uint32_t slot = KVS_REWRITE_SLOTS;
+	unsafe
+	{
+		//Every bit which changes must still be blank
+		for(uint32_t i=0; i<len; i++)
+		{
+			uint8_t changed = p[i] ^ data[i];
+			if(changed & (p[i] ^ BLANK_FLASH_BYTE))
+				return false;
+
+			if(changed)
+			{
+				if(first == len)
+					first = i;
+				last = i;
+			}
+		}
+
+		//Find the first free CRC slot
+		for(uint32_t i=0; i<KVS_REWRITE_SLOTS; i++)
+		{
+			uint32_t value;
+			memcpy(&value, p + len + i*sizeof(uint32_t), sizeof(value));
+			if(value == BLANK_FLASH_X32)
+			{
+				slot = i;
+				break;
+			}
+		}
+	}
+	if(m_eccFault)
+	{
+		m_eccFault = false;
+		return false;
+	}
+
+	//Nothing to do?
+	if(first == len)
+		return true;
+
+	//Out of slots? A CRC which looks blank can't be recorded either
+	uint32_t crc = m_active->CRC(data, len);
+	if( (slot == KVS_REWRITE_SLOTS) || (crc == BLANK_FLASH_X32) )
+		return false;
+
+	//Record the new CRC, then program the changed bytes and make sure it all took
+	uint32_t offset = log->m_start + len + slot*sizeof(uint32_t);
+	if(!m_active->Write(offset, reinterpret_cast<uint8_t*>(&crc), sizeof(crc)))
+		return false;
+	if(!m_active->Write(log->m_start + first, data + first, last + 1 - first))
+		return false;
+
+	bool ok = false;
+	unsafe
+	{
+		ok = (memcmp(p, data, len) == 0) && CheckDataCRC(m_active, log);
+	}
+	if(m_eccFault || !ok)
+	{
+		m_eccFault = false;
+		return false;
+	}
+
+	DropCachedWrites(log->m_key, KVS_NAMELEN);
+	NotifyWatchers(log, log->m_key, KVS_NAMELEN);
+	return true;
+}
+
+/**
+	@brief Appends content to the end of an object, for journals, event logs, and similar
+
+	Only the new content is written, as a segment with its own log entry and CRC, so appending to a large object
+	doesn't copy it. ReadObject() and GetObjectSize() treat the object and its segments as one; MapObject() only maps
+	the first segment, and GetNextSegment() walks the rest. Compaction merges the segments into a single payload.
+
+	If the object doesn't exist it is created. If it exists but wasn't written by this function, its current content
+	is first written again as a new revision which can be appended to. Objects which can't be memory mapped
+	(compressed, counters, and deltas) can't be appended to.
+
+	A segment whose CRC doesn't match (e.g. from a power failure while appending) is left out of the object.
+
+	@param name		Name of the object (see StoreObject)
+	@param data		Content to append
+	@param len		Length of the content to append
+ */
+bool KVS::AppendObject(const char* name, const uint8_t* data, uint32_t len)
+{
+	//A zero-length segment would read as a deletion
+	if(len == 0)
+		return true;
+
+	//Can't write to the active bank while it's being copied, and need the latest content in flash
+	if(!FinishCompact())
+		return false;
+	if(FindCachedWrite(name) && !Flush())
+		return false;
+
+	//Convert an existing object to an appendable one. Its content is written straight from flash, and stays valid
+	//even if this triggers a compaction, since the old bank isn't erased until the next one.
+	auto log = FindObject(name);
+	if(log && !(log->m_flags & LogEntry::FLAG_APPENDABLE) )
+	{
+		auto content = MapObject(log);
+		if(!content)
+			return false;
+
+		bool ok = false;
+		for(int i=0; (i<5) && !ok; i++)
+			ok = StoreObjectInternal(name, content, GetObjectSize(log), LogEntry::FLAG_APPENDABLE);
+		if(!ok)
+			return false;
+	}
+
+	uint32_t flags = log ? LogEntry::FLAG_SEGMENT : LogEntry::FLAG_APPENDABLE;
+	for(int i=0; i<5; i++)
+	{
+		if(StoreObjectInternal(name, data, len, flags))
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Finds the segment appended after part of an appendable object
+
+	@param log		Log entry for the object (as returned by FindObject()) or one of its segments
+
+	@return The next segment, or NULL if there are no more
+ */
+LogEntry* KVS::GetNextSegment(LogEntry* log)
+{
+	auto bank = GetBankContaining(log);
+	auto base = bank->GetLog();
+
+	m_eccFault = false;
+	uint32_t end = 0;
+	unsafe
+	{
+		end = bank->GetHeader()->m_logSize;
+	}
+
+	for(uint32_t i=(log - base) + 1; i<end; i++)
+	{
+		if(IsLogEntryBlank(&base[i]))
+			break;
+
+		bool segment = false;
+		bool valid = false;
+		unsafe
+		{
+			//A prefix delete covering the object ends it
+			if(base[i].m_flags & LogEntry::FLAG_PREFIX_DELETE)
+			{
+				if(MatchesPrefixDelete(&base[i], log->m_key) && (HeaderCRC(&base[i]) == base[i].m_headerCRC) )
+					return nullptr;
+				continue;
+			}
+
+			if(memcmp(base[i].m_key, log->m_key, KVS_NAMELEN) != 0)
+				continue;
+
+			segment = (base[i].m_flags & LogEntry::FLAG_SEGMENT);
+			valid = (HeaderCRC(&base[i]) == base[i].m_headerCRC) && CheckDataCRC(bank, &base[i]);
+		}
+
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::GetNextSegment: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			continue;
+		}
+
+		//Any other entry with the same name (even a corrupted one) is a newer revision, so the object ends here
+		if(!segment)
+			return nullptr;
+
+		//Skip over corrupted segments
+		if(valid)
+			return &base[i];
+	}
+
+	return nullptr;
+}
+
+/**
+	@brief Calculates the CRC of the full content of an appendable or delta object, as if it were one contiguous payload
+
+	@return False if the content could not be read
+ */
+bool KVS::GetContentCRC(LogEntry* log, uint32_t& crc)
+{
+	auto bank = GetBankContaining(log);
+	crc = bank->CRCStart();
+
+	//Deltas are rebuilt a chunk at a time
+	if(log->m_flags & LogEntry::FLAG_DELTA)
+	{
+		uint8_t buf[KVS_STREAM_BUFFER_SIZE];
+		uint32_t size = GetObjectSize(log);
+		for(uint32_t off=0; off<size; off += KVS_STREAM_BUFFER_SIZE)
+		{
+			uint32_t chunk = size - off;
+			if(chunk > KVS_STREAM_BUFFER_SIZE)
+				chunk = KVS_STREAM_BUFFER_SIZE;
+			if(!ReadRange(bank, log, off, buf, chunk))
+				return false;
+			crc = bank->CRCUpdate(crc, buf, chunk);
+		}
+	}
+
+	//Appendable objects are checksummed one segment at a time
+	else
+	{
+		m_eccFault = false;
+		for(auto seg = log; seg; seg = GetNextSegment(seg))
+		{
+			unsafe
+			{
+				crc = bank->CRCUpdate(crc, bank->GetBase() + seg->m_start, seg->m_len);
+			}
+			if(m_eccFault)
+			{
+				m_eccFault = false;
+				return false;
+			}
+		}
+	}
+
+	crc = bank->CRCFinal(crc);
+	return true;
+}
+
+/**
+	@brief Writes a counter to the store, replacing any existing object by the same name.
+
+	A counter reads like a uint32_t object, but can be incremented in place by IncrementCounter().
+
+	@param name		Name of the object (see StoreObject)
+	@param value	Initial value of the counter
+ */
+bool KVS::StoreCounter(const char* name, uint32_t value)
+{
+	for(int i=0; i<5; i++)
+	{
+		if(StoreObjectInternal(name, (const uint8_t*)&value, sizeof(value), LogEntry::FLAG_COUNTER))
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Increments a counter
+
+	Most increments program a single bit (or write block) of the space reserved in the counter, with no new log entry.
+	Once that space is used up, a new revision of the counter is written with the current value as its base.
+	Compaction folds counters in the same way.
+
+	If the object doesn't exist it is created as a counter with value 1. If it exists but isn't a counter, a 4-byte
+	object is taken as the starting value and converted to a counter; anything else starts from zero.
+
+	Increments in place do not add a log entry, so they are not reported by GetNextChange() and don't change the
+	revision returned by GetRevision(). StoreObjectIfRevision() therefore refuses to overwrite a counter. Watches are
+	notified.
+ */
+bool KVS::IncrementCounter(const char* name)
+{
+	//Can't write to the active bank while it's being copied, and need the latest value in flash
+	if(!FinishCompact())
+		return false;
+	if(FindCachedWrite(name) && !Flush())
+		return false;
+
+	uint32_t value = 0;
+	auto log = FindObject(name);
+	if(log && (log->m_flags & LogEntry::FLAG_COUNTER) )
+	{
+		m_eccFault = false;
+		uint32_t count = GetCounterIncrements(m_active, log);
+		value = GetCounterValue(m_active, log);
+		if(m_eccFault)
+			m_eccFault = false;
+
+		//Program the next unused increment, then make sure it counts
+		else if(count < KVS_COUNTER_INCREMENTS)
+		{
+			uint32_t offset = log->m_start + COUNTER_HEADER_SIZE;
+			#ifdef MICROKVS_WRITE_BLOCK_SIZE
+				uint8_t buf[MICROKVS_WRITE_BLOCK_SIZE];
+				memset(buf, ~BLANK_FLASH_BYTE, sizeof(buf));
+				offset += count * MICROKVS_WRITE_BLOCK_SIZE;
+			#else
+				uint8_t buf[1] = { static_cast<uint8_t>(BLANK_FLASH_BYTE ^ ((2 << (count % 8)) - 1)) };
+				offset += count / 8;
+			#endif
+
+			if(m_active->Write(offset, buf, sizeof(buf)) && (GetCounterIncrements(m_active, log) == count + 1) )
+			{
+				DropCachedWrites(log->m_key, KVS_NAMELEN);
+				NotifyWatchers(log, log->m_key, KVS_NAMELEN);
+				return true;
+			}
+
+			//Didn't take, the increment space is probably damaged. Fall back to a new revision.
+			m_eccFault = false;
+		}
+	}
+	else if(log && (GetObjectSize(log) == sizeof(uint32_t)) )
+		value = ReadValue<uint32_t>(log, 0);
+
+	return StoreCounter(name, value + 1);
+}
+
+/**
+	@brief Counts the increments used in a counter object
+
+	An increment which reads back with an ECC error was interrupted part way through programming, but still counts.
+ */
+uint32_t KVS::GetCounterIncrements(StorageBank* bank, const LogEntry* log)
+{
+	auto p = bank->GetBase() + log->m_start + COUNTER_HEADER_SIZE;
+	uint32_t count = 0;
+
+	#ifdef MICROKVS_WRITE_BLOCK_SIZE
+
+		//One write block per increment. They're used in order, so stop at the first blank one
+		for(; count < KVS_COUNTER_INCREMENTS; count++)
+		{
+			m_eccFault = false;
+			bool blank = true;
+			unsafe
+			{
+				for(uint32_t i=0; i<MICROKVS_WRITE_BLOCK_SIZE; i++)
+				{
+					if(p[count*MICROKVS_WRITE_BLOCK_SIZE + i] != BLANK_FLASH_BYTE)
+						blank = false;
+				}
+			}
+			if(blank && !m_eccFault)
+				break;
+		}
+		m_eccFault = false;
+
+	#else
+
+		//One bit per increment, starting from the LSB of the first byte
+		for(uint32_t i=0; i<(KVS_COUNTER_INCREMENTS + 7)/8; i++)
+		{
+			uint8_t used = 0;
+			unsafe
+			{
+				used = p[i] ^ BLANK_FLASH_BYTE;
+			}
+			count += __builtin_popcount(used);
+			if(used != 0xff)
+				break;
+		}
+		if(count > KVS_COUNTER_INCREMENTS)
+			count = KVS_COUNTER_INCREMENTS;
+
+	#endif
+
+	return count;
+}
+
+/**
+	@brief Gets the current value of a counter object: its base value plus the number of increments used
+
+	The caller should check m_eccFault afterwards.
+ */
+uint32_t KVS::GetCounterValue(StorageBank* bank, const LogEntry* log)
+{
+	uint32_t base = 0;
+	unsafe
+	{
+		memcpy(&base, bank->GetBase() + log->m_start, sizeof(base));
+	}
+	bool fault = m_eccFault;
+	uint32_t value = base + GetCounterIncrements(bank, log);
+	m_eccFault = fault;
+	return value;
+}
+
+/**
+	@brief Deletes an object from the store.
+
+	The deletion is recorded as a zero-length log entry, no data is written. The space used by the object is reclaimed
+	at the next compaction. Nothing is written if the object doesn't exist. Any deferred write of the object which
+	hasn't been flushed yet is discarded.
+
+	@param name		Name of the object (see StoreObject)
+
+	@return True if the object no longer exists
+ */
+bool KVS::DeleteObject(const char* name)
+{
+	char key[KVS_NAMELEN] = {0};
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Wstringop-truncation"
+	strncpy(key, name, KVS_NAMELEN);
+	#pragma GCC diagnostic pop
+	DropCachedWrites(key, KVS_NAMELEN);
+
+	if(!FindObject(name))
+		return true;
+	return StoreObject(name, nullptr, 0);
+}
+
+/**
+	@brief Deletes every object whose name begins with a given prefix (e.g. "user.")
+
+	The deletion is recorded as a single log entry regardless of how many objects it affects. Objects with a matching
+	name which are stored after this call are not affected.
+
+	@param prefix	Name prefix to delete. Only the first KVS_NAMELEN characters are significant, and it may not be
+					empty (use WipeAll() to delete everything).
+
+	@return True if the deletion was recorded successfully
+ */
+bool KVS::DeletePrefix(const char* prefix)
+{
+	if(prefix[0] == '\0')
+		return false;
+
+	for(int i=0; i<5; i++)
+	{
+		if(StoreObjectInternal(prefix, nullptr, 0, LogEntry::FLAG_PREFIX_DELETE))
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Core of StoreObject
+
+	@param flags	LogEntry flags to store the object with
+	@param patch	If not null, data is the bytes replaced in a patched revision rather than the whole object
+ */
+bool KVS::StoreObjectInternal(
+	const char* name,
+	const uint8_t* data,
+	uint32_t len,
+	uint32_t flags,
+	const KVSPatch* patch)
+{
+	//Can't append to the log while it's being copied
+	if(!FinishCompact())
+		return false;
+
+	m_eccFault = false;
+
+	//Actual lookup key: zero padded if too short, but not guaranteed to be null terminated
+	char key[KVS_NAMELEN] = {0};
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Wstringop-truncation"
+	strncpy(key, name, KVS_NAMELEN);
+	#pragma GCC diagnostic pop
+
+	//Figure out what we're actually going to write: size and CRC of the content as stored
+	uint32_t storedLen = len;
+	uint32_t dataCRC = 0;
+	if(flags & LogEntry::FLAG_COMPRESSED)
+	{
+		KVSCRCSink sink(m_active);
+		if(!LZCodec::Compress(data, len, &sink))
+			return false;
+		storedLen = sink.GetLength();
+		dataCRC = sink.GetCRC();
+
+		//Didn't get any smaller? Store it uncompressed
+		if(storedLen >= len)
+		{
+			flags &= ~LogEntry::FLAG_COMPRESSED;
+			storedLen = len;
+		}
+	}
+
+	//Deltas are generated twice in the same way, against the latest revision. If the chain is too long, the lengths
+	//differ, or it doesn't save at least half the space, write a full copy instead.
+	LogEntry* deltaBase = nullptr;
+	if(flags & LogEntry::FLAG_DELTA)
+	{
+		flags &= ~LogEntry::FLAG_DELTA;
+		deltaBase = FindDeltaBase(m_active, m_firstFreeLogEntry, key);
+		if(deltaBase && (GetObjectSize(deltaBase) == len) )
+		{
+			uint32_t depth = 0;
+			if(deltaBase->m_flags & LogEntry::FLAG_DELTA)
+			{
+				KVSDeltaHeader header = {0, KVS_DELTA_CHAIN_MAX};
+				unsafe
+				{
+					memcpy(&header, m_active->GetBase() + deltaBase->m_start, sizeof(header));
+				}
+				depth = header.m_depth;
+			}
+
+			KVSCRCSink sink(m_active);
+			if( (depth < KVS_DELTA_CHAIN_MAX) && EncodeDelta(deltaBase, data, len, &sink) &&
+				(sink.GetLength() <= len / 2) )
+			{
+				flags |= LogEntry::FLAG_DELTA;
+				storedLen = sink.GetLength();
+				dataCRC = sink.GetCRC();
+			}
+		}
+	}
+
+	//Patched revisions are also generated twice, copying the unchanged content from the previous revision
+	if(patch)
+	{
+		KVSCRCSink sink(m_active);
+		if(!GeneratePatch(patch, data, len, &sink))
+			return false;
+		storedLen = sink.GetLength();
+		dataCRC = sink.GetCRC();
+	}
+
+	//Counters reserve space for increments after the base value
+	if(flags & LogEntry::FLAG_COUNTER)
+		storedLen = COUNTER_SIZE;
+
+	//Chunked objects have their chunk CRCs and length after the content, and m_crc covers those instead
+	if(flags & LogEntry::FLAG_CHUNKED)
+	{
+		KVSCRCSink sink(m_active);
+		WriteChunkTable(m_active, data, len, &sink);
+		storedLen = len + sink.GetLength();
+		dataCRC = sink.GetCRC();
+	}
+
+	//Rewritable objects reserve space for CRCs of in-place updates after the content
+	if(flags & LogEntry::FLAG_REWRITABLE)
+		storedLen = len + REWRITE_SLOTS_SIZE;
+
+	//Tiny objects go in the log entry in place of the start pointer, there's no data to write or CRC separately
+	uint32_t inlineValue = 0;
+	if( (flags == 0) && !patch && (len != 0) && (len <= KVS_INLINE_MAX) )
+	{
+		flags = LogEntry::FLAG_INLINE;
+		memcpy(&inlineValue, data, len);
+	}
+	else if(!(flags & (LogEntry::FLAG_COMPRESSED | LogEntry::FLAG_DELTA | LogEntry::FLAG_CHUNKED)) && !patch)
+		dataCRC = m_active->CRC(data, len);
+	bool needData = (storedLen != 0) && !(flags & LogEntry::FLAG_INLINE);
+
+	//Make sure there's header space, compacting the store to make more room if needed
+	if(GetFreeLogEntries() < 1)
+		Compact();
+	if(GetFreeLogEntries() < 1)
+		return false;
+
+	//Prefix deletes record the length of the prefix in place of the start pointer
+	if(flags & LogEntry::FLAG_PREFIX_DELETE)
+		inlineValue = strnlen(name, KVS_NAMELEN);
+
+	//If identical content is already in the active bank, point the new log entry at it instead of writing it again
+	uint32_t start = inlineValue;
+	bool shared = needData && !patch &&
+		!(flags & (LogEntry::FLAG_COUNTER | LogEntry::FLAG_REWRITABLE | LogEntry::FLAG_DELTA)) &&
+		FindDuplicatePayload(data, len, storedLen, flags, dataCRC, start);
+
+	if(needData && !shared)
+	{
+		//If there's not enough space for the file, compact the store to make more room
+		if(GetFreeDataSpace() < storedLen)
+		{
+			if(!Compact())
+				return false;
+		}
+
+		//If not enough space after compaction, we're out of flash. Give up.
+		if(GetFreeDataSpace() < storedLen)
+			return false;
+
+		start = m_firstFreeData;
+	}
+
+	//Calculate expected header CRC
+	LogEntry tempHeader;
+	memset(&tempHeader, 0, sizeof(tempHeader));
+	memcpy(tempHeader.m_key, key, KVS_NAMELEN);
+	tempHeader.m_start = start;
+	tempHeader.m_len = storedLen;
+	tempHeader.m_flags = flags;
+	tempHeader.m_crc = dataCRC;
+	tempHeader.m_headerCRC = 0;
+	auto headerCRC = HeaderCRC(&tempHeader);
+
+	//From here on, the object might exist
+	if(!(flags & LogEntry::FLAG_PREFIX_DELETE))
+		MarkOverridden(key);
+
+	uint32_t logindex = m_firstFreeLogEntry;
+	unsafe
+	{
+		//Write header data to reserve the log entry
+		uint32_t logoff = sizeof(BankHeader) + logindex*sizeof(LogEntry);
+		uint32_t header[5] = { start, storedLen, flags, dataCRC, headerCRC};
+		m_firstFreeLogEntry ++;
+		if(!m_active->Write(logoff + KVS_NAMELEN, reinterpret_cast<uint8_t*>(&header[0]), sizeof(header)))
+			return false;
+
+		//Write and verify object content
+		//(skip this if there's no data, empty objects are allowed and treated as nonexistent)
+		if(needData && !shared)
+		{
+			auto offset = m_firstFreeData;
+
+			//Blank check the region as a sanity check
+			auto base = m_active->GetBase();
+			while(true)
+			{
+				bool blank = true;
+				for(uint32_t i=0; i<storedLen; i++)
+				{
+					if(base[offset + i] != BLANK_FLASH_BYTE)
+					{
+						blank = false;
+						break;
+					}
+				}
+
+				if(blank)
+					break;
+
+				//not blank, move forward one write block and try again
+				m_firstFreeData = RoundUpToDataAlignment(m_firstFreeData + 1);
+				offset = m_firstFreeData;
+
+				//If no longer enough space, try compacting
+				if(GetFreeDataSpace() < storedLen)
+				{
+					if(!Compact())
+						return false;
+					offset = m_firstFreeData;
+				}
+				if(GetFreeDataSpace() < storedLen)
+					return false;
+			}
+
+			m_firstFreeData = RoundUpToDataAlignment(m_firstFreeData + storedLen);
+
+			//Compressed content is generated again straight into flash, then verified by CRC
+			if(flags & LogEntry::FLAG_COMPRESSED)
+			{
+				KVSFlashSink sink(m_active, offset);
+				if(!LZCodec::Compress(data, len, &sink))
+					return false;
+				if(!sink.Flush())
+					return false;
+				if(m_active->CRC(base + offset, storedLen) != dataCRC)
+					return false;
+			}
+
+			//Deltas are encoded again in the same way
+			else if(flags & LogEntry::FLAG_DELTA)
+			{
+				KVSFlashSink sink(m_active, offset);
+				if(!EncodeDelta(deltaBase, data, len, &sink))
+					return false;
+				if(!sink.Flush())
+					return false;
+				if(m_active->CRC(base + offset, storedLen) != dataCRC)
+					return false;
+			}
+
+			//Chunked objects have the chunk CRCs written straight after the content
+			else if(flags & LogEntry::FLAG_CHUNKED)
+			{
+				KVSFlashSink sink(m_active, offset);
+				if(!sink.Write(data, len) || !WriteChunkTable(m_active, data, len, &sink) || !sink.Flush())
+					return false;
+				if(memcmp(data, base + offset, len) != 0)
+					return false;
+				if(m_active->CRC(base + offset + len, storedLen - len) != dataCRC)
+					return false;
+			}
+
+			//Patched revisions are generated again too. Whole write blocks of unchanged content before the patch are
+			//copied flash to flash, unless the base is a delta and has to be rebuilt.
+			else if(patch)
+			{
+				uint32_t head = 0;
+				if(!(patch->m_base->m_flags & LogEntry::FLAG_DELTA))
+				{
+					head = patch->m_offset;
+					#ifdef MICROKVS_WRITE_BLOCK_SIZE
+						head -= head % MICROKVS_WRITE_BLOCK_SIZE;
+					#endif
+				}
+				auto src = GetBankContaining(patch->m_base);
+				if(head && !m_active->Copy(src, patch->m_base->m_start, offset, head))
+					return false;
+
+				KVSFlashSink sink(m_active, offset + head);
+				if(!GeneratePatch(patch, data, len, &sink, head))
+					return false;
+				if(!sink.Flush())
+					return false;
+				if(m_active->CRC(base + offset, storedLen) != dataCRC)
+					return false;
+			}
+
+			else
+			{
+				if(!m_active->Write(offset, data, len))
+					return false;
+				if(memcmp(data, base + offset, len) != 0)
+					return false;
+			}
+		}
+
+		//Write and verify object name
+		if(!m_active->Write(logoff, reinterpret_cast<uint8_t*>(key), KVS_NAMELEN))
+			return false;
+		if(memcmp(key, m_active->GetBase() + logoff, KVS_NAMELEN) != 0)
+			return false;
+
+		//Make the new content available for sharing by later writes
+		if(needData && !shared)
+			AddToDedupTable(dataCRC, logindex);
+	}
+
+	//Let readers see the new object
+	PublishSnapshot();
+
+	//Anything still waiting to be written for the object is older than this
+	uint32_t keylen = (flags & LogEntry::FLAG_PREFIX_DELETE) ? start : KVS_NAMELEN;
+	DropCachedWrites(key, keylen);
+
+	//Tell anyone interested about the change
+	NotifyWatchers(&m_active->GetLog()[logindex], key, keylen);
+
+	//All good!
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Backup and restore
+
+/**
+	@brief Header of one object in a snapshot stream
+
+	A snapshot stream consists of two uint32_t's (SNAPSHOT_MAGIC and KVS_NAMELEN), then for each object a frame header
+	followed by m_len bytes of content, and finally a frame header with m_len = 0 and m_crc = the number of objects.
+ */
+struct KVSSnapshotFrame
+{
+	char		m_key[KVS_NAMELEN];
+	uint32_t	m_flags;		//LogEntry flags (only FLAG_COMPRESSED is allowed)
+	uint32_t	m_len;			//Number of bytes of content, as stored
+	uint32_t	m_crc;			//crc32 of content, as stored
+	uint32_t	m_headerCRC;	//crc32 of the rest of the frame header
+};
+
+/**
+	@brief Writes the current version of every object to a stream, for backup or cloning to another device
+
+	Objects are written as stored (compressed objects stay compressed), in chunks of at most KVS_STREAM_BUFFER_SIZE
+	bytes. Old revisions and deleted objects are not included. No RAM is needed beyond a single chunk buffer and a
+	cache of KVS_COMPACT_CACHE_SIZE recently exported names.
+
+	The log is walked backwards in a single pass, so objects appear in the stream newest first. Like compaction, the
+	rest of the log is only searched for an object whose name has fallen out of the cache.
+
+	Deferred writes still held in the write cache are flushed first, so the snapshot includes them.
+
+	@param sink		Destination for the stream
+
+	@return False if the sink reported an error, an object could not be read, or the write cache couldn't be flushed
+ */
+bool KVS::ExportSnapshot(KVSByteSink* sink)
+{
+	if(!Flush())
+		return false;
+
+	uint32_t header[2] = { SNAPSHOT_MAGIC, KVS_NAMELEN };
+	if(!sink->Write(reinterpret_cast<uint8_t*>(header), sizeof(header)))
+		return false;
+
+	KVSReadLock lock(this);
+	auto bank = lock.GetBank();
+	auto len = lock.GetLogEnd();
+	auto log = bank->GetLog();
+
+	//Names of objects recently found to be exported or deleted, so older revisions can be skipped without a search
+	char seen[KVS_COMPACT_CACHE_SIZE][KVS_NAMELEN];
+	uint32_t nseen = 0;
+	uint32_t nextSeen = 0;
+
+	//Walk the log backwards, so the first valid entry found for each object is its current version
+	KVSSnapshotFrame frame;
+	uint32_t count = 0;
+	for(uint32_t n=len; n>0; n--)
+	{
+		uint32_t i = n-1;
+		m_eccFault = false;
+
+		//Prefix deletes are never exported, and segments are exported along with the object they were appended to
+		bool skip = false;
+		unsafe
+		{
+			memcpy(frame.m_key, log[i].m_key, KVS_NAMELEN);
+			skip = (log[i].m_flags & (LogEntry::FLAG_PREFIX_DELETE | LogEntry::FLAG_SEGMENT) );
+		}
+		if(m_eccFault || skip)
+			continue;
+
+		bool found = false;
+		for(uint32_t j=0; (j<nseen) && !found; j++)
+			found = (memcmp(seen[j], frame.m_key, KVS_NAMELEN) == 0);
+		if(found)
+			continue;
+
+		//Ignore corrupted entries, an older revision may still be good
+		bool valid = false;
+		unsafe
+		{
+			valid = ( (log[i].m_headerCRC == 0) || (HeaderCRC(&log[i]) == log[i].m_headerCRC) ) &&
+				CheckDataCRC(bank, &log[i]);
+		}
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::ExportSnapshot: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			continue;
+		}
+		if(!valid)
+			continue;
+
+		//Not in the cache, so check the rest of the log for a newer revision or a deletion
+		bool superseded = IsSupersededAfter(bank, i, len);
+		memcpy(seen[nextSeen], frame.m_key, KVS_NAMELEN);
+		nextSeen = (nextSeen + 1) % KVS_COMPACT_CACHE_SIZE;
+		if(nseen < KVS_COMPACT_CACHE_SIZE)
+			nseen ++;
+
+		//Only export the current version of the object, if it hasn't been deleted
+		if(superseded || (log[i].m_len == 0) )
+			continue;
+
+		//Inline objects are exported like any other and may be stored differently when imported
+		const uint8_t* src = bank->GetBase() + log[i].m_start;
+		frame.m_flags = log[i].m_flags;
+		frame.m_len = log[i].m_len;
+		frame.m_crc = log[i].m_crc;
+		uint32_t counter = 0;
+		if(frame.m_flags & LogEntry::FLAG_INLINE)
+		{
+			src = reinterpret_cast<const uint8_t*>(&log[i].m_start);
+			frame.m_flags = 0;
+			frame.m_crc = bank->CRC(src, frame.m_len);
+		}
+
+		//Appendable and delta objects are exported as plain objects, with their segments merged or chain folded
+		else if(frame.m_flags & (LogEntry::FLAG_APPENDABLE | LogEntry::FLAG_DELTA) )
+		{
+			frame.m_flags = 0;
+			frame.m_len = GetObjectSize(&log[i]);
+			if(!GetContentCRC(&log[i], frame.m_crc))
+				return false;
+		}
+
+		//Rewritable and chunked objects are exported as plain objects, without their CRC slots or chunk CRCs.
+		//The chunks haven't necessarily been checked yet, so do that first rather than export corrupted content.
+		else if(frame.m_flags & (LogEntry::FLAG_REWRITABLE | LogEntry::FLAG_CHUNKED) )
+		{
+			if(!VerifyObjectRange(&log[i], 0, GetObjectSize(&log[i])))
+				continue;
+			frame.m_flags = 0;
+			frame.m_len = GetObjectSize(&log[i]);
+			frame.m_crc = bank->CRC(src, frame.m_len);
+		}
+
+		//Counters are exported as their current value, and become counters again when next incremented
+		else if(frame.m_flags & LogEntry::FLAG_COUNTER)
+		{
+			counter = GetCounterValue(bank, &log[i]);
+			src = reinterpret_cast<const uint8_t*>(&counter);
+			frame.m_flags = 0;
+			frame.m_len = sizeof(counter);
+			frame.m_crc = bank->CRC(src, frame.m_len);
+		}
+		frame.m_headerCRC = bank->CRC(reinterpret_cast<uint8_t*>(&frame), sizeof(frame) - sizeof(uint32_t));
+		if(!sink->Write(reinterpret_cast<uint8_t*>(&frame), sizeof(frame)))
+			return false;
+
+		//Copy the content through RAM so an ECC error can't happen inside the sink.
+		//Appendable objects are copied one segment at a time.
+		uint8_t buf[KVS_STREAM_BUFFER_SIZE];
+		bool appendable = (log[i].m_flags & LogEntry::FLAG_APPENDABLE);
+		bool delta = (log[i].m_flags & LogEntry::FLAG_DELTA);
+		auto seg = &log[i];
+		uint32_t seglen = appendable ? seg->m_len : frame.m_len;
+		for(uint32_t off=0; true; off += KVS_STREAM_BUFFER_SIZE)
+		{
+			//Appendable objects continue in their segments
+			if(off >= seglen)
+			{
+				seg = appendable ? GetNextSegment(seg) : nullptr;
+				if(!seg)
+					break;
+				src = bank->GetBase() + seg->m_start;
+				seglen = seg->m_len;
+				off = 0;
+			}
+
+			uint32_t chunk = seglen - off;
+			if(chunk > KVS_STREAM_BUFFER_SIZE)
+				chunk = KVS_STREAM_BUFFER_SIZE;
+
+			if(delta)
+			{
+				if(!ReadRange(bank, &log[i], off, buf, chunk))
+					return false;
+			}
+			else
+			{
+				unsafe
+				{
+					memcpy(buf, src + off, chunk);
+				}
+				if(m_eccFault)
+				{
+					m_eccFault = false;
+					g_log(Logger::WARNING, "KVS::ExportSnapshot: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+						m_eccFaultAddr, m_eccFaultPC);
+					return false;
+				}
+			}
+
+			if(!sink->Write(buf, chunk))
+				return false;
+		}
+
+		count ++;
+	}
+
+	//End of stream
+	memset(&frame, 0, sizeof(frame));
+	frame.m_crc = count;
+	frame.m_headerCRC = bank->CRC(reinterpret_cast<uint8_t*>(&frame), sizeof(frame) - sizeof(uint32_t));
+	return sink->Write(reinterpret_cast<uint8_t*>(&frame), sizeof(frame));
+}
+
+/**
+	@brief Replaces the entire content of the store with a stream from ExportSnapshot()
+
+	The objects are written in a single sequential pass into the inactive bank, which then becomes the active bank, as
+	if a compaction had taken place. If anything goes wrong (corrupted stream, not enough space, write error) the
+	current content of the store is left untouched.
+
+	@param source	Source of the stream
+
+	@return True if the snapshot was imported successfully
+ */
+bool KVS::ImportSnapshot(KVSByteSource* source)
+{
+	if(!FinishCompact())
+		return false;
+
+	uint32_t header[2];
+	if(!source->Read(reinterpret_cast<uint8_t*>(header), sizeof(header)))
+		return false;
+	if( (header[0] != SNAPSHOT_MAGIC) || (header[1] != KVS_NAMELEN) )
+		return false;
+
+	//Erase the inactive bank, but do NOT write the header until we're done.
+	//Readers may still be using it if they started before the last compaction.
+	auto inactive = GetInactiveBank();
+	if(!m_inactiveBlank)
+	{
+		WaitForReaders(inactive);
+		ClearChunkCache();
+		if(!inactive->Erase())
+			return false;
+	}
+	m_inactiveBlank = false;
+
+	uint32_t nextLog = 0;
+	uint32_t nextData = RoundUpToDataAlignment(sizeof(BankHeader) + m_defaultLogSize*sizeof(LogEntry));
+	uint32_t count = 0;
+	while(true)
+	{
+		KVSSnapshotFrame frame;
+		if(!source->Read(reinterpret_cast<uint8_t*>(&frame), sizeof(frame)))
+			return false;
+		if(inactive->CRC(reinterpret_cast<uint8_t*>(&frame), sizeof(frame) - sizeof(uint32_t)) != frame.m_headerCRC)
+			return false;
+
+		//End of stream? Make sure we didn't lose anything
+		if(frame.m_len == 0)
+		{
+			if(frame.m_crc != count)
+				return false;
+			break;
+		}
+
+		if( (frame.m_flags & ~LogEntry::FLAG_COMPRESSED) || (nextLog >= m_defaultLogSize) )
+			return false;
+
+		LogEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		memcpy(entry.m_key, frame.m_key, KVS_NAMELEN);
+		entry.m_len = frame.m_len;
+		entry.m_flags = frame.m_flags;
+		entry.m_crc = frame.m_crc;
+
+		//Tiny objects go in the log entry
+		if( (frame.m_flags == 0) && (frame.m_len <= KVS_INLINE_MAX) )
+		{
+			uint32_t value = 0;
+			if(!source->Read(reinterpret_cast<uint8_t*>(&value), frame.m_len))
+				return false;
+			if(inactive->CRC(reinterpret_cast<uint8_t*>(&value), frame.m_len) != frame.m_crc)
+				return false;
+
+			entry.m_start = value;
+			entry.m_flags = LogEntry::FLAG_INLINE;
+			entry.m_crc = 0;
+		}
+
+		//Everything else is copied to the data area, then verified
+		else
+		{
+			//(written this way round so a huge length can't wrap around)
+			if(frame.m_len > inactive->GetSize() - nextData)
+				return false;
+
+			KVSFlashSink sink(inactive, nextData);
+			uint8_t buf[KVS_STREAM_BUFFER_SIZE];
+			for(uint32_t off=0; off<frame.m_len; off += KVS_STREAM_BUFFER_SIZE)
+			{
+				uint32_t chunk = frame.m_len - off;
+				if(chunk > KVS_STREAM_BUFFER_SIZE)
+					chunk = KVS_STREAM_BUFFER_SIZE;
+				if(!source->Read(buf, chunk) || !sink.Write(buf, chunk))
+					return false;
+			}
+			if(!sink.Flush())
+				return false;
+			if(inactive->CRC(inactive->GetBase() + nextData, frame.m_len) != frame.m_crc)
+				return false;
+
+			entry.m_start = nextData;
+			nextData = RoundUpToDataAlignment(nextData + frame.m_len);
+		}
+
+		entry.m_headerCRC = HeaderCRC(&entry);
+		if(!inactive->Write(sizeof(BankHeader) + nextLog*sizeof(LogEntry), (uint8_t*)&entry, sizeof(entry)))
+			return false;
+		nextLog ++;
+		count ++;
+	}
+
+	//Write block header with the new version number, making the new bank valid
+	BankHeader bh;
+	memset(&bh, 0, sizeof(bh));
+	bh.m_magic = HEADER_MAGIC;
+	bh.m_version = m_active->GetHeader()->m_version + 1;
+	bh.m_logSize = m_defaultLogSize;
+	if(!inactive->Write(0, (uint8_t*)&bh, sizeof(bh)))
+		return false;
+
+	//Switch banks. The old bank is left intact until the next compaction, so readers still using it are unaffected
+	m_active = inactive;
+	ScanCurrentBank();
+	PublishSnapshot();
+
+	//The snapshot replaces anything not written yet
+	DropCachedWrites("", 0);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Incremental sync
+
+/**
+	@brief Returns a cursor pointing to the current end of the log
+
+	Changes made after this call can then be found with GetNextChange().
+ */
+KVSChangeCursor KVS::GetChangeCursor()
+{
+	KVSReadLock lock(this);
+
+	KVSChangeCursor cursor;
+	cursor.m_version = BLANK_FLASH_X32;
+	cursor.m_logIndex = lock.GetLogEnd();
+
+	m_eccFault = false;
+	unsafe
+	{
+		cursor.m_version = lock.GetBank()->GetHeader()->m_version;
+	}
+	if(m_eccFault)
+	{
+		m_eccFault = false;
+		cursor.m_version = BLANK_FLASH_X32;
+	}
+
+	return cursor;
+}
+
+/**
+	@brief Finds the next change made after a cursor, and advances the cursor past it
+
+	Changes are returned in the order they were made. Each change is a new revision of an object, a deletion (m_len is
+	zero), a prefix delete (FLAG_PREFIX_DELETE is set), or content appended to an object (FLAG_SEGMENT is set). An
+	object modified several times is returned once per modification; applying the changes in order gives the current
+	state.
+
+	@param cursor	Cursor from GetChangeCursor() or a previous call
+	@param log		Set to the log entry for the change, if one was found
+
+	@return	CHANGE_FOUND if a change was found
+			CHANGE_NONE if there are no more changes (the cursor can be used again later)
+			CHANGE_CURSOR_INVALID if the store has been compacted since the cursor was created. The caller must start
+			over with a full enumeration of the store and a new cursor.
+ */
+KVS::ChangeStatus KVS::GetNextChange(KVSChangeCursor& cursor, LogEntry*& log)
+{
+	KVSReadLock lock(this);
+	auto bank = lock.GetBank();
+	auto len = lock.GetLogEnd();
+
+	//Make sure the cursor refers to this version of the bank
+	uint32_t version = BLANK_FLASH_X32;
+	m_eccFault = false;
+	unsafe
+	{
+		version = bank->GetHeader()->m_version;
+	}
+	if(m_eccFault || (version == BLANK_FLASH_X32) || (version != cursor.m_version) || (cursor.m_logIndex > len) )
+	{
+		m_eccFault = false;
+		return CHANGE_CURSOR_INVALID;
+	}
+
+	auto base = bank->GetLog();
+	while(cursor.m_logIndex < len)
+	{
+		auto i = cursor.m_logIndex;
+		cursor.m_logIndex ++;
+
+		//Skip anything not committed, or corrupted
+		bool valid = false;
+		unsafe
+		{
+			if( (base[i].m_headerCRC == 0) || (HeaderCRC(&base[i]) == base[i].m_headerCRC) )
+				valid = CheckDataCRC(bank, &base[i]);
+		}
+
+		//If ECC fault, this entry is invalid
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::GetNextChange: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			continue;
+		}
+
+		if(valid)
+		{
+			log = &base[i];
+			return CHANGE_FOUND;
+		}
+	}
+
+	return CHANGE_NONE;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Optimistic concurrency
+
+/**
+	@brief Returns the revision of an object, for a later StoreObjectIfRevision()
+
+	The revision is the version of the active bank in the high 32 bits, and the log index of the latest entry for the
+	object (including a deletion) in the low 32 bits, or 0xffffffff if there is none. Every new log entry for the object
+	(a store or deletion), and every compaction, changes it. Counter increments and in-place updates of rewritable
+	objects add no log entry, so they don't.
+ */
+uint64_t KVS::GetRevision(const char* name)
+{
+	char key[KVS_NAMELEN] = {0};
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Wstringop-truncation"
+	strncpy(key, name, KVS_NAMELEN);
+	#pragma GCC diagnostic pop
+
+	KVSReadLock lock(this);
+	auto bank = lock.GetBank();
+	uint32_t index = BLANK_FLASH_X32;
+	auto log = FindObjectInRange(bank, key, 0, lock.GetLogEnd(), nullptr);
+	if(log)
+		index = log - bank->GetLog();
+
+	uint32_t version = BLANK_FLASH_X32;
+	m_eccFault = false;
+	unsafe
+	{
+		version = bank->GetHeader()->m_version;
+	}
+	m_eccFault = false;
+
+	return (static_cast<uint64_t>(version) << 32) | index;
+}
+
+/**
+	@brief Returns the revision of an object from a log entry returned by FindObject()
+
+	With MICROKVS_CONCURRENT_READERS, the KVSReadLock the entry was found under must still be held.
+ */
+uint64_t KVS::GetRevision(LogEntry* log)
+{
+	auto bank = GetBankContaining(log);
+	uint32_t version = BLANK_FLASH_X32;
+	m_eccFault = false;
+	unsafe
+	{
+		version = bank->GetHeader()->m_version;
+	}
+	m_eccFault = false;
+
+	return (static_cast<uint64_t>(version) << 32) | static_cast<uint32_t>(log - bank->GetLog());
+}
+
+/**
+	@brief Writes a new revision of an object, but only if nothing else has written it since expectedRevision
+
+	This allows read-modify-write updates without holding a lock across the read: read the object and its revision,
+	compute the new content, and store it with StoreObjectIfRevision(), starting over on REVISION_CHANGED. A compaction
+	in the meantime also changes the revision, so a retry is always needed rather than treating it as an error.
+
+	Counters and rewritable objects can't be written this way, since IncrementCounter() and in-place updates don't
+	change their revision. (In configurations where StoreRewritableObject() is the same as StoreObject(), its objects
+	are plain and can be.)
+
+	With MICROKVS_CONCURRENT_READERS, any number of threads may call this concurrently (but not concurrently with other
+	write functions, which must still be called from a single thread). If another thread is already inside this
+	function, it returns REVISION_BUSY immediately rather than waiting, so a low priority thread holding it can't stall
+	a higher priority one. The caller should retry, without needing to re-read first.
+
+	@param name				Name of the object
+	@param expectedRevision	Revision of the object (from GetRevision) the new content was computed from
+	@param data				Content of the object
+	@param len				Size of the object
+ */
+KVS::RevisionStatus KVS::StoreObjectIfRevision(
+	const char* name,
+	uint64_t expectedRevision,
+	const uint8_t* data,
+	uint32_t len)
+{
+	#ifdef MICROKVS_CONCURRENT_READERS
+	if(__atomic_test_and_set(&m_revisionWriter, __ATOMIC_ACQUIRE))
+		return REVISION_BUSY;
+	#endif
+
+	//A deferred write is newer than anything the caller could have seen in flash
+	RevisionStatus status = REVISION_STORED;
+	if(FindCachedWrite(name) && !Flush())
+		status = REVISION_FAILED;
+
+	//Counters and rewritable objects change without a new revision, so the caller may not have seen the latest content
+	if(status == REVISION_STORED)
+	{
+		auto log = FindObject(name);
+		if(log && (log->m_flags & (LogEntry::FLAG_COUNTER | LogEntry::FLAG_REWRITABLE)) )
+			status = REVISION_UNSUPPORTED;
+		else if(GetRevision(name) != expectedRevision)
+			status = REVISION_CHANGED;
+		else if(!StoreObject(name, data, len))
+			status = REVISION_FAILED;
+	}
+
+	#ifdef MICROKVS_CONCURRENT_READERS
+	__atomic_clear(&m_revisionWriter, __ATOMIC_RELEASE);
+	#endif
+
+	return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Write-back caching
+
+/**
+	@brief Sets the table used to hold objects written by StoreObjectDeferred()
+
+	No memory is allocated by the KVS, so the number of objects which can be held at once is the size of this table.
+	Anything held in the previous table is flushed first. Times are in whatever units the caller passes to
+	StoreObjectDeferred() and FlushExpired(), e.g. milliseconds or ticks of a free running timer.
+
+	The write cache is only accessed from the thread which writes to the store, so it can't be used with
+	MICROKVS_CONCURRENT_READERS.
+
+	@param table			Cache slots, which must remain valid for the lifetime of the KVS
+	@param size				Number of entries in table
+	@param maxAge			Longest time an object may be held before FlushExpired() writes it to flash
+	@param maxDirtyBytes	Largest total size of the objects held at once
+
+	@return False if the previous table couldn't be flushed, or the cache isn't available in this configuration
+ */
+bool KVS::SetWriteCache(KVSCachedWrite* table, uint32_t size, uint32_t maxAge, uint32_t maxDirtyBytes)
+{
+	#ifdef MICROKVS_CONCURRENT_READERS
+		(void)table;
+		(void)size;
+		(void)maxAge;
+		(void)maxDirtyBytes;
+		return false;
+	#else
+		if(!Flush())
+			return false;
+
+		memset(table, 0, size * sizeof(KVSCachedWrite));
+		m_writeCache = table;
+		m_writeCacheSize = size;
+		m_writeCacheMaxAge = maxAge;
+		m_writeCacheMaxDirty = maxDirtyBytes;
+		m_dirtyBytes = 0;
+		return true;
+	#endif
+}
+
+/**
+	@brief Writes a new object to the store, holding it in the write cache for a while in case it changes again
+
+	Repeated writes to the same object while it's held only change the cached copy. It's written to flash (along with
+	everything else in the cache) by Flush(), or by FlushExpired() once it has been held for longer than the maximum
+	age, or when the cache runs out of slots or dirty bytes. Anything not flushed before a reset is lost, so the
+	power-fail handler should call Flush().
+
+	Reads by name see the cached content. Pointers from FindObject() and MapObject() refer to the last version written
+	to flash, and watchers are only notified when the object is flushed.
+
+	Without a write cache, or if the object is larger than KVS_WRITE_CACHE_OBJECT_MAX, it's written immediately.
+
+	@param name		Name of the object
+	@param data		Content of the object
+	@param len		Size of the object
+	@param now		Current time
+ */
+bool KVS::StoreObjectDeferred(const char* name, const uint8_t* data, uint32_t len, uint32_t now)
+{
+	if( (m_writeCacheSize == 0) || (len > KVS_WRITE_CACHE_OBJECT_MAX) || (len > m_writeCacheMaxDirty) )
+		return StoreObject(name, data, len);
+
+	//Make room if this would go over either limit
+	auto slot = FindCachedWrite(name);
+	bool haveSlot = (slot != nullptr);
+	for(uint32_t i=0; (i<m_writeCacheSize) && !haveSlot; i++)
+		haveSlot = !m_writeCache[i].m_dirty;
+	uint32_t pending = slot ? slot->m_len : 0;
+	if(!haveSlot || (m_dirtyBytes - pending + len > m_writeCacheMaxDirty) )
+	{
+		if(!Flush())
+			return false;
+		slot = nullptr;
+	}
+
+	//New object: take a free slot
+	if(!slot)
+	{
+		for(uint32_t i=0; i<m_writeCacheSize; i++)
+		{
+			if(!m_writeCache[i].m_dirty)
+			{
+				slot = &m_writeCache[i];
+				break;
+			}
+		}
+
+		memset(slot->m_key, 0, KVS_NAMELEN);
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wstringop-truncation"
+		strncpy(slot->m_key, name, KVS_NAMELEN);
+		#pragma GCC diagnostic pop
+		slot->m_time = now;
+		slot->m_len = 0;
+		slot->m_dirty = true;
+	}
+
+	memcpy(slot->m_data, data, len);
+	m_dirtyBytes = m_dirtyBytes - slot->m_len + len;
+	slot->m_len = len;
+	return true;
+}
+
+/**
+	@brief Flushes the write cache if anything in it has been held for longer than the maximum age
+
+	Call this periodically, e.g. from the main loop.
+
+	@param now		Current time
+ */
+bool KVS::FlushExpired(uint32_t now)
+{
+	for(uint32_t i=0; i<m_writeCacheSize; i++)
+	{
+		auto& slot = m_writeCache[i];
+		if(slot.m_dirty && (now - slot.m_time >= m_writeCacheMaxAge) )
+			return Flush();
+	}
+	return true;
+}
+
+/**
+	@brief Writes everything held in the write cache to flash
+
+	There's no room reserved for a multi-object commit in the log, so the objects are written one at a time. Space for
+	all of them is made first, so they all go into the same bank without a compaction partway through.
+
+	@return True if everything was written. Objects which couldn't be written stay in the cache.
+ */
+bool KVS::Flush()
+{
+	uint32_t count = 0;
+	uint32_t bytes = 0;
+	for(uint32_t i=0; i<m_writeCacheSize; i++)
+	{
+		if(m_writeCache[i].m_dirty)
+		{
+			count ++;
+			bytes += RoundUpToDataAlignment(m_writeCache[i].m_len);
+		}
+	}
+	if(count == 0)
+		return true;
+
+	if( (GetFreeLogEntries() < count) || (GetFreeDataSpace() < bytes) )
+	{
+		if(!Compact())
+			return false;
+	}
+
+	//Storing each object drops it from the cache
+	bool ok = true;
+	for(uint32_t i=0; i<m_writeCacheSize; i++)
+	{
+		auto& slot = m_writeCache[i];
+		if(!slot.m_dirty)
+			continue;
+
+		char name[KVS_NAMELEN+1] = {0};
+		memcpy(name, slot.m_key, KVS_NAMELEN);
+		if(!StoreObject(name, slot.m_data, slot.m_len))
+			ok = false;
+	}
+	return ok;
+}
+
+/**
+	@brief Returns the write cache slot holding an object, or NULL if it isn't held
+ */
+KVSCachedWrite* KVS::FindCachedWrite(const char* name)
+{
+	for(uint32_t i=0; i<m_writeCacheSize; i++)
+	{
+		auto& slot = m_writeCache[i];
+		if(slot.m_dirty && (strncmp(slot.m_key, name, KVS_NAMELEN) == 0) )
+			return &slot;
+	}
+	return nullptr;
+}
+
+/**
+	@brief Discards held content which has been superseded by a write to flash
+
+	@param key		Name of the object, or a deleted prefix
+	@param keylen	Number of significant bytes in key (0 to discard everything)
+ */
+void KVS::DropCachedWrites(const char* key, uint32_t keylen)
+{
+	for(uint32_t i=0; i<m_writeCacheSize; i++)
+	{
+		auto& slot = m_writeCache[i];
+		if(slot.m_dirty && (memcmp(slot.m_key, key, keylen) == 0) )
+		{
+			slot.m_dirty = false;
+			m_dirtyBytes -= slot.m_len;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Compiled-in defaults
+
+/**
+	@brief Sets the table of compiled-in defaults
+
+	Objects in the table which don't exist read as their default (from ReadObject or ReadObjects) rather than failing.
+	The table also records which objects have never been written to the active bank, so looking those up doesn't
+	need to search the log. This costs one pass over the log now, and after each compaction or import.
+
+	@param table		Defaults, sorted by name (as by strcmp), which must remain valid for the lifetime of the KVS.
+						Typically a constexpr array.
+	@param size			Number of entries in table
+	@param overridden	Scratch bitmap of (size + 31) / 32 words, which must remain valid for the lifetime of the KVS
+
+	@return False (and no defaults are used) if the table is not sorted or has names longer than KVS_NAMELEN
+ */
+bool KVS::SetDefaults(const KVSDefault* table, uint32_t size, uint32_t* overridden)
+{
+	m_defaults = nullptr;
+	m_defaultsSize = 0;
+	m_overridden = nullptr;
+
+	for(uint32_t i=0; i<size; i++)
+	{
+		if(strlen(table[i].m_name) > KVS_NAMELEN)
+			return false;
+		if( (i > 0) && (strncmp(table[i-1].m_name, table[i].m_name, KVS_NAMELEN) >= 0) )
+			return false;
+	}
+
+	memset(overridden, 0, ((size + 31) / 32) * sizeof(uint32_t));
+	m_overridden = overridden;
+	m_defaultsSize = size;
+	m_defaults = table;
+
+	UpdateOverrides();
+	return true;
+}
+
+/**
+	@brief Returns the compiled-in default for an object, or NULL if it has none
+ */
+const KVSDefault* KVS::GetDefault(const char* name)
+{
+	auto i = FindDefaultIndex(name);
+	if(i < 0)
+		return nullptr;
+	return &m_defaults[i];
+}
+
+/**
+	@brief Looks up an object in the table of compiled-in defaults
+
+	@param name		Name of the object (null terminated, or a KVS_NAMELEN byte zero padded key)
+
+	@return Index in m_defaults, or -1 if not found
+ */
+int32_t KVS::FindDefaultIndex(const char* name)
+{
+	int32_t lo = 0;
+	int32_t hi = static_cast<int32_t>(m_defaultsSize) - 1;
+	while(lo <= hi)
+	{
+		int32_t mid = (lo + hi) / 2;
+		int cmp = strncmp(name, m_defaults[mid].m_name, KVS_NAMELEN);
+		if(cmp == 0)
+			return mid;
+		if(cmp < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+/**
+	@brief Records that an object with a compiled-in default might now exist in the active bank
+
+	Bits are only ever set here, never cleared, so readers never see an existing object as missing.
+ */
+void KVS::MarkOverridden(const char* key)
+{
+	auto i = FindDefaultIndex(key);
+	if(i < 0)
+		return;
+
+	#ifdef MICROKVS_CONCURRENT_READERS
+		__atomic_fetch_or(&m_overridden[i / 32], (1u << (i % 32)), __ATOMIC_SEQ_CST);
+	#else
+		m_overridden[i / 32] |= (1u << (i % 32));
+	#endif
+}
+
+/**
+	@brief Marks every object with a compiled-in default which appears in the active bank as overridden
+ */
+void KVS::UpdateOverrides()
+{
+	if(m_defaultsSize == 0)
+		return;
+
+	auto log = m_active->GetLog();
+	for(uint32_t i=0; i<m_firstFreeLogEntry; i++)
+	{
+		m_eccFault = false;
+		bool valid = false;
+		unsafe
+		{
+			valid = !(log[i].m_flags & LogEntry::FLAG_PREFIX_DELETE) &&
+				( (log[i].m_headerCRC == 0) || (HeaderCRC(&log[i]) == log[i].m_headerCRC) );
+		}
+
+		//Entries we can't read are skipped by lookups anyway
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::UpdateOverrides: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			continue;
+		}
+		if(valid)
+			MarkOverridden(log[i].m_key);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Change notification
+
+/**
+	@brief Sets the table used to store watch registrations
+
+	No memory is allocated by the KVS, so the maximum number of watches is the size of this table. Any existing
+	registrations are forgotten and the table is cleared.
+
+	Watches may only be added, removed, or triggered from the thread which writes to the store.
+
+	@param table	Table of watch registrations, which must remain valid for the lifetime of the KVS
+	@param size		Number of entries in table
+ */
+void KVS::SetWatchTable(KVSWatch* table, uint32_t size)
+{
+	m_watches = table;
+	m_watchTableSize = size;
+	memset(table, 0, size * sizeof(KVSWatch));
+}
+
+/**
+	@brief Registers a callback to be invoked whenever an object is stored or deleted
+
+	The callback is invoked from StoreObject (or DeleteObject, DeletePrefix) after the new log entry is committed. It
+	must not write to the store.
+
+	@return False if the watch table is full
+ */
+bool KVS::Watch(const char* name, KVSWatchCallback callback, void* param)
 {
-	for(int i=0; i<5; i++)
+	return AddWatch(name, KVS_NAMELEN, callback, param);
+}
+
+/**
+	@brief Registers a callback to be invoked whenever an object whose name begins with a given prefix is stored or
+	deleted
+
+	@return False if the watch table is full
+ */
+bool KVS::WatchPrefix(const char* prefix, KVSWatchCallback callback, void* param)
+{
+	return AddWatch(prefix, strnlen(prefix, KVS_NAMELEN), callback, param);
+}
+
+/**
+	@brief Removes all watches with the given callback and parameter
+ */
+void KVS::Unwatch(KVSWatchCallback callback, void* param)
+{
+	for(uint32_t i=0; i<m_watchTableSize; i++)
 	{
-		if(StoreObjectInternal(name, data, len))
-			return true;
+		if( (m_watches[i].m_callback == callback) && (m_watches[i].m_param == param) )
+			m_watches[i].m_callback = nullptr;
+	}
+}
+
+/**
+	@brief Adds an entry to the watch table
+
+	@param name		Name or prefix to watch
+	@param keylen	Number of significant bytes in name
+ */
+bool KVS::AddWatch(const char* name, uint32_t keylen, KVSWatchCallback callback, void* param)
+{
+	for(uint32_t i=0; i<m_watchTableSize; i++)
+	{
+		auto& w = m_watches[i];
+		if(w.m_callback != nullptr)
+			continue;
+
+		memset(w.m_key, 0, KVS_NAMELEN);
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wstringop-truncation"
+		strncpy(w.m_key, name, KVS_NAMELEN);
+		#pragma GCC diagnostic pop
+		w.m_keyLen = keylen;
+		w.m_callback = callback;
+		w.m_param = param;
+		return true;
 	}
+
 	return false;
 }
 
 /**
-	@brief Core of StoreObject
+	@brief Invokes the callbacks of all watches affected by a new log entry
+
+	@param log		The new log entry
+	@param key		Name of the object, or the deleted prefix
+	@param keylen	Number of significant bytes in key (KVS_NAMELEN unless this is a prefix delete)
  */
-bool KVS::StoreObjectInternal(const char* name, const uint8_t* data, uint32_t len)
+void KVS::NotifyWatchers(LogEntry* log, const char* key, uint32_t keylen)
 {
-	m_eccFault = false;
+	for(uint32_t i=0; i<m_watchTableSize; i++)
+	{
+		auto& w = m_watches[i];
+		if(w.m_callback == nullptr)
+			continue;
 
-	//Actual lookup key: zero padded if too short, but not guaranteed to be null terminated
-	char key[KVS_NAMELEN] = {0};
-	#pragma GCC diagnostic push
-	#pragma GCC diagnostic ignored "-Wstringop-truncation"
-	strncpy(key, name, KVS_NAMELEN);
-	#pragma GCC diagnostic pop
+		//A prefix watch and a prefix delete overlap if they agree as far as the shorter of the two goes
+		uint32_t len = (w.m_keyLen < keylen) ? w.m_keyLen : keylen;
+		if(memcmp(w.m_key, key, len) == 0)
+			w.m_callback(this, log, w.m_param);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Deduplication
 
-	//If there's not enough space for the file, compact the store to make more room
-	if(GetFreeDataSpace() < len)
+/**
+	@brief Sink which compares a stream against existing content instead of storing it
+ */
+class KVSCompareSink : public KVSByteSink
+{
+public:
+	KVSCompareSink(const uint8_t* expected)
+	: m_expected(expected)
+	{}
+
+	virtual bool Write(const uint8_t* data, uint32_t len)
 	{
-		if(!Compact())
+		if(memcmp(data, m_expected, len) != 0)
 			return false;
+		m_expected += len;
+		return true;
 	}
 
-	//If not enough space after compaction, we're out of flash. Give up.
-	if(GetFreeDataSpace() < len)
-		return false;
+protected:
+	const uint8_t* m_expected;
+};
 
-	//Same thing, but make sure there's header space
-	if(GetFreeLogEntries() < 1)
-		Compact();
-	if(GetFreeLogEntries() < 1)
-		return false;
+/**
+	@brief Forgets all payloads available for deduplication
+ */
+void KVS::ClearDedupTable()
+{
+	#if KVS_DEDUP_TABLE_SIZE > 0
+		memset(m_dedupTable, 0, sizeof(m_dedupTable));
+	#endif
+}
 
-	//Calculate expected data CRC
-	auto dataCRC = m_active->CRC(data, len);
+/**
+	@brief Records that the payload of a log entry in the active bank can be shared by later writes
 
-	//Calculate expected header CRC
-	LogEntry tempHeader;
-	memset(&tempHeader, 0, sizeof(tempHeader));
-	memcpy(tempHeader.m_key, key, KVS_NAMELEN);
-	tempHeader.m_start = m_firstFreeData;
-	tempHeader.m_len = len;
-	tempHeader.m_crc = dataCRC;
-	tempHeader.m_headerCRC = 0;
-	auto headerCRC = HeaderCRC(&tempHeader);
+	Each CRC value maps to a single table slot; a newer payload replaces whatever was there before.
+ */
+void KVS::AddToDedupTable([[maybe_unused]] uint32_t crc, [[maybe_unused]] uint32_t logindex)
+{
+	#if KVS_DEDUP_TABLE_SIZE > 0
+		m_dedupTable[crc % KVS_DEDUP_TABLE_SIZE] = logindex + 1;
+	#endif
+}
 
-	unsafe
-	{
-		//Write header data to reserve the log entry
-		uint32_t logoff = sizeof(BankHeader) + m_firstFreeLogEntry*sizeof(LogEntry);
-		uint32_t header[4] = { m_firstFreeData, len, dataCRC, headerCRC};
-		m_firstFreeLogEntry ++;
-		if(!m_active->Write(logoff + KVS_NAMELEN, reinterpret_cast<uint8_t*>(&header[0]), sizeof(header)))
+/**
+	@brief Looks for an existing payload in the active bank which is byte-for-byte identical to one we're about to write
+
+	Candidates are found by CRC in the dedup table, then confirmed by comparing the actual content. Superseded
+	revisions are fine to share since their content stays in the bank until the next compaction.
+
+	@param data			Object content (uncompressed)
+	@param len			Length of the object content
+	@param storedLen	Number of bytes the content will occupy in flash
+	@param flags		LogEntry flags the content will be stored with
+	@param crc			CRC of the content as stored
+	@param start		Set to the offset of the existing payload, if found
+
+	@return True if a matching payload was found
+ */
+bool KVS::FindDuplicatePayload(
+	[[maybe_unused]] const uint8_t* data,
+	[[maybe_unused]] uint32_t len,
+	[[maybe_unused]] uint32_t storedLen,
+	[[maybe_unused]] uint32_t flags,
+	[[maybe_unused]] uint32_t crc,
+	[[maybe_unused]] uint32_t& start)
+{
+	#if KVS_DEDUP_TABLE_SIZE > 0
+		uint32_t slot = m_dedupTable[crc % KVS_DEDUP_TABLE_SIZE];
+		if( (slot == 0) || (slot > m_firstFreeLogEntry) )
 			return false;
+		auto log = &m_active->GetLog()[slot - 1];
+		auto base = m_active->GetBase();
 
-		//Write and verify object content
-		//(skip this if there's no data, empty objects are allowed and treated as nonexistent)
-		if(len != 0)
+		m_eccFault = false;
+		bool match = false;
+		unsafe
 		{
-			auto offset = m_firstFreeData;
+			//Cheap checks on the log entry first
+			if( (log->m_crc != crc) || (log->m_len != storedLen) || (log->m_flags != flags) )
+				return false;
+			if(log->m_headerCRC != HeaderCRC(log))
+				return false;
 
-			//Blank check the region as a sanity check
-			auto base = m_active->GetBase();
-			while(true)
+			//Then confirm the content is actually the same
+			if(flags & LogEntry::FLAG_COMPRESSED)
 			{
-				bool blank = true;
-				for(uint32_t i=0; i<len; i++)
-				{
-					if(base[offset + i] != BLANK_FLASH_BYTE)
-					{
-						blank = false;
-						break;
-					}
-				}
+				KVSCompareSink sink(base + log->m_start);
+				match = LZCodec::Compress(data, len, &sink);
+			}
+			else
+				match = (memcmp(data, base + log->m_start, len) == 0);
+		}
 
-				if(blank)
-					break;
+		if(m_eccFault || !match)
+			return false;
 
-				//not blank, move forward one write block and try again
-				m_firstFreeData = RoundUpToWriteBlockSize(m_firstFreeData + 1);
-				offset = m_firstFreeData;
+		start = log->m_start;
+		return true;
+	#else
+		return false;
+	#endif
+}
 
-				//If no longer enough space, try compacting
-				if(GetFreeDataSpace() < len)
-				{
-					if(!Compact())
-						return false;
-					offset = m_firstFreeData;
-				}
-				if(GetFreeDataSpace() < len)
-					return false;
-			}
+/**
+	@brief Writes a value to the KVS if necessary.
 
-			m_firstFreeData = RoundUpToWriteBlockSize(m_firstFreeData + len);
-			if(!m_active->Write(offset, data, len))
-				return false;
-			if(memcmp(data, base + offset, len) != 0)
-				return false;
+	If the value is the same as the previous value in the KVS, or there is no previous value
+	but the value being written is the same as the default value, no data is written.
+ */
+bool KVS::StoreStringObjectIfNecessary(const char* name, const char* currentValue, const char* defaultValue)
+{
+	auto valueLen = strlen(currentValue);
+
+	//If there's a deferred write pending, that's the current value
+	auto cached = FindCachedWrite(name);
+	if(cached)
+	{
+		if( (cached->m_len == valueLen) && (memcmp(cached->m_data, currentValue, valueLen) == 0) )
+			return true;
+		return StoreObject(name, (uint8_t*)currentValue, valueLen);
+	}
+
+	//Check if we already have the same string stored, early out if so
+	auto hobject = FindObject(name);
+	if(hobject)
+	{
+		auto oldval = (const char*)MapObject(hobject);
+		if( oldval && (valueLen == GetObjectSize(hobject)) && (!strncmp(currentValue, oldval, valueLen)) )
+			return true;
+	}
+
+	//No existing object. Before we store the new one, check if it's the default and skip the store if so
+	else
+	{
+		auto def = GetDefault(name);
+		if(def && (def->m_len == valueLen) && !memcmp(def->m_data, currentValue, valueLen) )
+			return true;
+		if(!def && !strcmp(currentValue, defaultValue))
+			return true;
+	}
+
+	//Need to store the value (different from default and/or existing value
+	return StoreObject(name, (uint8_t*)currentValue, valueLen);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Compaction
+
+/**
+	@brief Moves all active objects to the inactive bank, reclaiming free space in the process
+
+	Blocks until the compaction is complete. If an asynchronous compaction is already in progress, it is finished.
+ */
+bool KVS::Compact()
+{
+	if(!IsCompacting() && !StartCompact())
+		return false;
+	return FinishCompact();
+}
+
+/**
+	@brief Blocks until any compaction in progress completes
+
+	@return True if there was no compaction in progress, or it completed successfully
+ */
+bool KVS::FinishCompact()
+{
+	AsyncStatus status;
+	while( (status = PollCompact()) == ASYNC_BUSY )
+	{}
+	return (status == ASYNC_DONE);
+}
+
+/**
+	@brief Starts a compaction without waiting for it to complete
+
+	The compaction is then advanced by calling PollCompact() until it no longer returns ASYNC_BUSY. Each call does as
+	much work as possible without waiting for the flash (using the asynchronous StorageBank API).
+
+	Any call which writes to the store while a compaction is in progress will finish the compaction first.
+
+	@return True if the compaction was started, false if one is already in progress
+ */
+bool KVS::StartCompact()
+{
+	if(IsCompacting())
+		return false;
+
+	//Find the INACTIVE storage bank
+	m_compactTarget = GetInactiveBank();
+
+	m_compactIndex = static_cast<int64_t>(m_firstFreeLogEntry)-1;
+	m_compactNextLog = 0;
+	m_compactNextData = RoundUpToDataAlignment(sizeof(BankHeader) + m_defaultLogSize*sizeof(LogEntry));
+	memset(m_compactCache, BLANK_FLASH_BYTE, sizeof(m_compactCache));
+	m_compactNextCache = 0;
+	m_compactSource = nullptr;
+	m_compactRemaining = 0;
+
+	//Find the last deletion in the log, so we know how far ahead to look when checking if an object was deleted
+	auto log = m_active->GetLog();
+	m_compactLastDelete = -1;
+	for(uint32_t i=0; i<m_firstFreeLogEntry; i++)
+	{
+		m_eccFault = false;
+		bool deletion = false;
+		unsafe
+		{
+			deletion = (log[i].m_len == 0);
 		}
+		if(deletion && !m_eccFault)
+			m_compactLastDelete = i;
+	}
+	m_eccFault = false;
 
-		//Write and verify object name
-		if(!m_active->Write(logoff, reinterpret_cast<uint8_t*>(key), KVS_NAMELEN))
-			return false;
-		if(memcmp(key, m_active->GetBase() + logoff, KVS_NAMELEN) != 0)
-			return false;
+	//If the inactive bank was already erased ahead of time, skip straight to copying.
+	//Either way, it won't be blank any more once we start writing to it.
+	if(m_inactiveBlank)
+	{
+		ClearDedupTable();
+		m_compactState = COMPACT_SCAN;
+	}
+	else
+		m_compactState = COMPACT_WAIT_READERS;
+	m_inactiveBlank = false;
+
+	return true;
+}
+
+/**
+	@brief Erases the inactive bank ahead of time, so that the next compaction doesn't have to.
+
+	Intended to be called when the application is idle, since erasing is slow. The bank is blank checked after erasing.
+	Does nothing if the inactive bank is already known to be blank.
+
+	@return True if the inactive bank is now blank
+ */
+bool KVS::PrepareInactiveBank()
+{
+	if(!FinishCompact())
+		return false;
+	if(m_inactiveBlank)
+		return true;
+
+	//Readers may still be using it if they started before the last compaction
+	auto inactive = GetInactiveBank();
+	WaitForReaders(inactive);
+	ClearChunkCache();
+	if(!inactive->Erase())
+		return false;
+
+	m_inactiveBlank = IsBankBlank(inactive, 1);
+	return m_inactiveBlank;
+}
+
+/**
+	@brief Checks if a bank is blank
+
+	@param bank		The bank to check
+	@param stride	Check every Nth 32-bit word (1 = full check)
+ */
+bool KVS::IsBankBlank(StorageBank* bank, uint32_t stride)
+{
+	auto p = reinterpret_cast<const uint32_t*>(bank->GetBase());
+	uint32_t nwords = bank->GetSize() / sizeof(uint32_t);
+
+	m_eccFault = false;
+	bool blank = true;
+	unsafe
+	{
+		for(uint32_t i=0; i<nwords; i += stride)
+		{
+			if(p[i] != BLANK_FLASH_X32)
+			{
+				blank = false;
+				break;
+			}
+		}
+
+		//Always check the very end too, in case the stride skipped it
+		if(p[nwords - 1] != BLANK_FLASH_X32)
+			blank = false;
+	}
+
+	//Erased flash shouldn't give ECC errors, but if it does we certainly can't trust it
+	if(m_eccFault)
+	{
+		m_eccFault = false;
+		g_log(Logger::WARNING, "KVS::IsBankBlank: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+			m_eccFaultAddr, m_eccFaultPC);
+		return false;
 	}
 
-	//All good!
-	return true;
-}
+	return blank;
+}
+
+/**
+	@brief Advances a compaction started by StartCompact()
+
+	@return	ASYNC_BUSY if the compaction is still in progress
+			ASYNC_DONE if it completed successfully (or none was in progress)
+			ASYNC_FAILED if it failed
+ */
+KVS::AsyncStatus KVS::PollCompact()
+{
+	auto inactive = m_compactTarget;
+
+	while(true)
+	{
+		switch(m_compactState)
+		{
+			case COMPACT_IDLE:
+				return ASYNC_DONE;
+
+			//Erase the inactive bank, but do NOT write the header yet.
+			//If we're interrupted during the compaction, we want the block to read as invalid.
+			//Readers may still be using it if they started before the last compaction; wait for them to finish first.
+			case COMPACT_WAIT_READERS:
+				if(HasReaders(inactive))
+					return ASYNC_BUSY;
+				ClearChunkCache();
+				if(!inactive->StartErase())
+					return AbortCompact();
+				m_compactState = COMPACT_ERASING;
+				break;
+
+			case COMPACT_ERASING:
+				if(inactive->IsBusy())
+					return ASYNC_BUSY;
+				if(!inactive->GetLastResult())
+					return AbortCompact();
+				ClearDedupTable();
+				m_compactState = COMPACT_SCAN;
+				break;
+
+			//Find the next object to copy and start writing it
+			case COMPACT_SCAN:
+				if(!CompactScan())
+					return AbortCompact();
+				break;
+
+			//Data is written, now write the log entry pointing to it
+			case COMPACT_WRITE_DATA:
+				if(inactive->IsBusy())
+					return ASYNC_BUSY;
+				if(!inactive->GetLastResult())
+					return AbortCompact();
+
+				//Appendable and delta objects being rebuilt are written a chunk at a time
+				if(m_compactRemaining)
+				{
+					if(!CompactWriteChunk())
+						return AbortCompact();
+					break;
+				}
 
-/**
-	@brief Writes a value to the KVS if necessary.
+				if(!inactive->StartWrite(
+					sizeof(BankHeader) + m_compactNextLog*sizeof(LogEntry),
+					(uint8_t*)&m_compactEntry,
+					sizeof(m_compactEntry)))
+				{
+					return AbortCompact();
+				}
+				m_compactState = COMPACT_WRITE_LOG;
+				break;
 
-	If the value is the same as the previous value in the KVS, or there is no previous value
-	but the value being written is the same as the default value, no data is written.
- */
-bool KVS::StoreStringObjectIfNecessary(const char* name, const char* currentValue, const char* defaultValue)
-{
-	auto valueLen = strlen(currentValue);
+			//Log entry is written, move on to the next object
+			case COMPACT_WRITE_LOG:
+				if(inactive->IsBusy())
+					return ASYNC_BUSY;
+				if(!inactive->GetLastResult())
+					return AbortCompact();
+				if(!(m_compactEntry.m_flags & LogEntry::FLAG_INLINE))
+					AddToDedupTable(m_compactEntry.m_crc, m_compactNextLog);
+				m_compactNextLog ++;
+				m_compactState = COMPACT_SCAN;
+				break;
 
-	//Check if we already have the same string stored, early out if so
-	auto hobject = FindObject(name);
-	if(hobject)
-	{
-		auto oldval = (const char*)MapObject(hobject);
-		if( (valueLen == hobject->m_len) && (!strncmp(currentValue, oldval, hobject->m_len)) )
-			return true;
-	}
+			//Header is written, the new bank is valid
+			case COMPACT_WRITE_HEADER:
+				if(inactive->IsBusy())
+					return ASYNC_BUSY;
+				if(!inactive->GetLastResult())
+					return AbortCompact();
 
-	//No existing object. Before we store the new one, check if it's the default and skip the store if so
-	else if(!strcmp(currentValue, defaultValue))
-		return true;
+				//Done, switch banks
+				//The old bank is left intact until the next compaction, so readers still using it are unaffected
+				m_active = inactive;
+				m_firstFreeLogEntry = m_compactNextLog;
+				m_firstFreeData = m_compactNextData;
+				PublishSnapshot();
 
-	//Need to store the value (different from default and/or existing value
-	return StoreObject(name, (uint8_t*)currentValue, valueLen);
-}
+				//Round free data pointer to start of next write block
+				m_firstFreeData = RoundUpToDataAlignment(m_firstFreeData);
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Compaction
+				m_compactState = COMPACT_IDLE;
+				return ASYNC_DONE;
+		}
+	}
+}
 
 /**
-	@brief Moves all active objects to the inactive bank, reclaiming free space in the process
+	@brief Cancels a compaction after an error
  */
-bool KVS::Compact()
+KVS::AsyncStatus KVS::AbortCompact()
 {
-	const uint32_t cachesize = 16;
-	char cache[cachesize][KVS_NAMELEN];
-	memset(cache, BLANK_FLASH_BYTE, sizeof(cache));
-	uint32_t nextCache = 0;
+	m_compactState = COMPACT_IDLE;
+	return ASYNC_FAILED;
+}
 
-	//Find the INACTIVE storage bank
-	StorageBank* inactive = nullptr;
-	if(m_active == m_left)
-		inactive = m_right;
-	else
-		inactive = m_left;
+/**
+	@brief Walks the log backwards from m_compactIndex to find the next object which needs to be copied, and starts
+	writing it to the inactive bank.
+
+	Once all objects are copied, starts writing the bank header instead.
 
+	@return False if a write could not be started
+ */
+bool KVS::CompactScan()
+{
+	auto inactive = m_compactTarget;
 	auto base = m_active->GetBase();
 	auto log = m_active->GetLog();
 	auto outlog = inactive->GetLog();
-	uint32_t nextLog = 0;
-	uint32_t nextData = RoundUpToWriteBlockSize(sizeof(BankHeader) + m_defaultLogSize*sizeof(LogEntry));
-
-	//Erase the inactive bank and give it a header, but do NOT write the version number yet.
-	//If we're interrupted during the compaction, we want the block to read as invalid.
-	if(!inactive->Erase())
-		return false;
 
 	//Loop over the log and copy objects one by one
-	for(int64_t i = static_cast<int64_t>(m_firstFreeLogEntry)-1; i>=0; i--)
+	for(; m_compactIndex >= 0; m_compactIndex--)
 	{
+		auto i = m_compactIndex;
+
+		//Prefix deletes are never copied. The objects they delete are simply left behind.
+		//Segments are copied along with the object they were appended to.
+		m_eccFault = false;
+		bool skip = false;
+		unsafe
+		{
+			skip = (log[i].m_flags & (LogEntry::FLAG_PREFIX_DELETE | LogEntry::FLAG_SEGMENT) );
+		}
+		if(skip || m_eccFault)
+			continue;
+
 		//See if this item is in the cache.
 		//If so, it was already copied so no need to do a full search of the log
 		bool found = false;
-		for(uint32_t j=0; j<cachesize; j++)
+		for(uint32_t j=0; j<KVS_COMPACT_CACHE_SIZE; j++)
 		{
-			if(memcmp(cache[j], log[i].m_key, KVS_NAMELEN) == 0)
+			if(memcmp(m_compactCache[j], log[i].m_key, KVS_NAMELEN) == 0)
 			{
 				found = true;
 				break;
@@ -564,7 +4116,7 @@ bool KVS::Compact()
 		//Not in cache. Search the output log to see if it's there
 		if(!found)
 		{
-			for(uint32_t j=0; j<nextLog; j++)
+			for(uint32_t j=0; j<m_compactNextLog; j++)
 			{
 				m_eccFault = false;
 
@@ -600,11 +4152,10 @@ bool KVS::Compact()
 				continue;
 
 			//If CRC is invalid, ignore the corrupted object
-			if(m_active->CRC(base + log[i].m_start, log[i].m_len) != log[i].m_crc)
+			if(!CheckDataCRC(m_active, &log[i]))
 				continue;
 		}
 
-		//If ECC fault, this entry is invalid
 		//If ECC fault, this entry is invalid
 		if(m_eccFault)
 		{
@@ -615,51 +4166,270 @@ bool KVS::Compact()
 			continue;
 		}
 
-		//Not found. This is the most up to date version.
-		//Only write it if there's valid data (empty objects get removed during the compaction step)
-		if(log[i].m_len != 0)
+		//Not found. This is the most up to date version, unless it was deleted later on.
+		//Deleted objects aren't in the output log, and may have fallen out of the cache, so check the log itself.
+		bool deleted = IsDeletedAfter(i);
+
+		//Add this entry to the cache of recently copied stuff
+		memcpy(m_compactCache[m_compactNextCache], log[i].m_key, KVS_NAMELEN);
+		m_compactNextCache = (m_compactNextCache + 1) % KVS_COMPACT_CACHE_SIZE;
+
+		//Only write it if there's valid data (empty and deleted objects get removed during the compaction step)
+		if(deleted || (log[i].m_len == 0) )
+			continue;
+
+		//Appendable and delta objects are rebuilt as one contiguous payload, so we need its CRC up front.
+		//If the content can't be read there's nothing to copy.
+		uint32_t contentCRC = 0;
+		if( (log[i].m_flags & (LogEntry::FLAG_APPENDABLE | LogEntry::FLAG_DELTA)) && !GetContentCRC(&log[i], contentCRC) )
+			continue;
+		m_compactIndex --;
+
+		//Inline objects are just the log entry
+		m_compactEntry = log[i];
+		if(m_compactEntry.m_flags & LogEntry::FLAG_INLINE)
 		{
-			//Copy the data first, then the log
-			if(!inactive->Write(nextData, base + log[i].m_start, log[i].m_len))
-				return false;
+			m_compactState = COMPACT_WRITE_LOG;
+			return inactive->StartWrite(
+				sizeof(BankHeader) + m_compactNextLog*sizeof(LogEntry),
+				(uint8_t*)&m_compactEntry,
+				sizeof(m_compactEntry));
+		}
 
-			LogEntry entry = log[i];
-			entry.m_start = nextData;
-			entry.m_headerCRC = HeaderCRC(&entry);
-			if(!inactive->Write(sizeof(BankHeader) + nextLog*sizeof(LogEntry), (uint8_t*)&entry, sizeof(entry)))
-				return false;
+		//Counters are folded: the new copy has the current value as its base, and no increments used
+		if(m_compactEntry.m_flags & LogEntry::FLAG_COUNTER)
+		{
+			m_compactCounter = GetCounterValue(m_active, &log[i]);
+			m_compactEntry.m_start = m_compactNextData;
+			m_compactEntry.m_crc = m_active->CRC((uint8_t*)&m_compactCounter, sizeof(m_compactCounter));
+			m_compactEntry.m_headerCRC = HeaderCRC(&m_compactEntry);
+			m_compactNextData = RoundUpToDataAlignment(m_compactNextData + log[i].m_len);
+			m_compactState = COMPACT_WRITE_DATA;
+			return inactive->StartWrite(m_compactEntry.m_start, (uint8_t*)&m_compactCounter, sizeof(m_compactCounter));
+		}
 
-			//Update pointers for next output
-			nextData = RoundUpToWriteBlockSize(nextData + log[i].m_len);
-			nextLog ++;
+		//Appendable objects are merged with their segments and deltas folded into a full copy, streamed through RAM
+		if(m_compactEntry.m_flags & (LogEntry::FLAG_APPENDABLE | LogEntry::FLAG_DELTA) )
+		{
+			m_compactEntry.m_flags &= ~LogEntry::FLAG_DELTA;
+			m_compactEntry.m_len = GetObjectSize(&log[i]);
+			m_compactEntry.m_crc = contentCRC;
+			m_compactEntry.m_start = m_compactNextData;
+			m_compactEntry.m_headerCRC = HeaderCRC(&m_compactEntry);
+			m_compactNextData = RoundUpToDataAlignment(m_compactNextData + m_compactEntry.m_len);
+			m_compactSource = &log[i];
+			m_compactSourcePos = 0;
+			m_compactRemaining = m_compactEntry.m_len;
+			m_compactWritePos = m_compactEntry.m_start;
+			m_compactState = COMPACT_WRITE_DATA;
+			return CompactWriteChunk();
 		}
 
-		//Add this entry to the cache of recently copied stuff
-		memcpy(cache[nextCache], log[i].m_key, KVS_NAMELEN);
-		nextCache = (nextCache + 1) % cachesize;
+		//Rewritable objects get a fresh set of CRC slots, so only the current content is copied
+		uint32_t copyLen = log[i].m_len;
+		bool rewritable = (m_compactEntry.m_flags & LogEntry::FLAG_REWRITABLE);
+		if(rewritable)
+		{
+			copyLen = GetObjectSize(&m_compactEntry);
+			m_compactEntry.m_crc = m_active->CRC(base + m_compactEntry.m_start, copyLen);
+		}
+
+		//If an object we already copied has identical content, share it rather than copying again.
+		//This preserves any deduplication done when the objects were written.
+		//(Rewritable objects can't be shared since they may change later)
+		for(uint32_t j=0; (j<m_compactNextLog) && !rewritable; j++)
+		{
+			if( (outlog[j].m_crc == m_compactEntry.m_crc) &&
+				(outlog[j].m_len == m_compactEntry.m_len) &&
+				(outlog[j].m_flags == m_compactEntry.m_flags) &&
+				(memcmp(inactive->GetBase() + outlog[j].m_start, base + m_compactEntry.m_start, m_compactEntry.m_len) == 0) )
+			{
+				m_compactEntry.m_start = outlog[j].m_start;
+				m_compactEntry.m_headerCRC = HeaderCRC(&m_compactEntry);
+				m_compactState = COMPACT_WRITE_LOG;
+				return inactive->StartWrite(
+					sizeof(BankHeader) + m_compactNextLog*sizeof(LogEntry),
+					(uint8_t*)&m_compactEntry,
+					sizeof(m_compactEntry));
+			}
+		}
+
+		//Copy the data first (flash to flash, so the driver can use DMA if it has it), then the log
+		m_compactEntry.m_start = m_compactNextData;
+		m_compactEntry.m_headerCRC = HeaderCRC(&m_compactEntry);
+		m_compactNextData = RoundUpToDataAlignment(m_compactNextData + log[i].m_len);
+		m_compactState = COMPACT_WRITE_DATA;
+		return inactive->StartCopy(m_active, log[i].m_start, m_compactEntry.m_start, copyLen);
 	}
 
 	//Write block header with the new version number
 	//Need to write the entire bank header in one go, since our flash write block size may be >4 bytes!
-	BankHeader header;
-	memset(&header, 0, sizeof(header));
-	header.m_magic = HEADER_MAGIC;
-	header.m_version = m_active->GetHeader()->m_version + 1;
-	header.m_logSize = m_defaultLogSize;
-	if(!inactive->Write(0, (uint8_t*)&header, sizeof(header)))
+	memset(&m_compactHeader, 0, sizeof(m_compactHeader));
+	m_compactHeader.m_magic = HEADER_MAGIC;
+	m_compactHeader.m_version = m_active->GetHeader()->m_version + 1;
+	m_compactHeader.m_logSize = m_defaultLogSize;
+	m_compactState = COMPACT_WRITE_HEADER;
+	return inactive->StartWrite(0, (uint8_t*)&m_compactHeader, sizeof(m_compactHeader));
+}
+
+/**
+	@brief Starts writing the next chunk of an appendable or delta object being rebuilt by compaction
+
+	Chunks are KVS_STREAM_BUFFER_SIZE bytes (except for the last) so every write starts on a write block boundary.
+ */
+bool KVS::CompactWriteChunk()
+{
+	uint32_t fill = 0;
+
+	//Deltas are rebuilt a chunk at a time
+	if(m_compactSource->m_flags & LogEntry::FLAG_DELTA)
+	{
+		fill = m_compactRemaining;
+		if(fill > KVS_STREAM_BUFFER_SIZE)
+			fill = KVS_STREAM_BUFFER_SIZE;
+		if(!ReadRange(m_active, m_compactSource, m_compactSourcePos, m_compactBuf, fill))
+			return false;
+		m_compactSourcePos += fill;
+	}
+
+	//Appendable objects are copied one segment at a time
+	while(m_compactSource && (fill < KVS_STREAM_BUFFER_SIZE) && !(m_compactSource->m_flags & LogEntry::FLAG_DELTA))
+	{
+		uint32_t chunk = m_compactSource->m_len - m_compactSourcePos;
+		if(chunk > KVS_STREAM_BUFFER_SIZE - fill)
+			chunk = KVS_STREAM_BUFFER_SIZE - fill;
+
+		m_eccFault = false;
+		unsafe
+		{
+			memcpy(m_compactBuf + fill, m_active->GetBase() + m_compactSource->m_start + m_compactSourcePos, chunk);
+		}
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::Compact: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			return false;
+		}
+
+		fill += chunk;
+		m_compactSourcePos += chunk;
+		if(m_compactSourcePos == m_compactSource->m_len)
+		{
+			m_compactSource = GetNextSegment(m_compactSource);
+			m_compactSourcePos = 0;
+		}
+	}
+
+	//Should add up to the size we already allocated
+	if( (fill == 0) || (fill > m_compactRemaining) )
 		return false;
+	m_compactRemaining -= fill;
 
-	//Done, switch banks
-	m_active = inactive;
-	m_firstFreeLogEntry = nextLog;
-	m_firstFreeData = nextData;
+	uint32_t offset = m_compactWritePos;
+	m_compactWritePos += fill;
+	return m_compactTarget->StartWrite(offset, m_compactBuf, fill);
+}
 
-	//Round free data pointer to start of next write block
-	#ifdef MICROKVS_WRITE_BLOCK_SIZE
-		m_firstFreeData += (MICROKVS_WRITE_BLOCK_SIZE - (m_firstFreeData % MICROKVS_WRITE_BLOCK_SIZE));
-	#endif
+/**
+	@brief Checks if an object in the active bank is deleted by a later log entry
 
-	return true;
+	Only zero-length entries (deletions of a single object) and prefix deletes are considered, so this is a cheap scan
+	which stops at the last deletion in the log. Newer revisions with content are found in the output log instead.
+
+	@param i	Index of the log entry to check
+ */
+bool KVS::IsDeletedAfter(int64_t i)
+{
+	auto log = m_active->GetLog();
+	auto key = log[i].m_key;
+	for(int64_t j=i+1; j<=m_compactLastDelete; j++)
+	{
+		m_eccFault = false;
+		bool deleted = false;
+
+		unsafe
+		{
+			//Deletions are the only entries with no content
+			if(log[j].m_len != 0)
+				continue;
+
+			if(log[j].m_flags & LogEntry::FLAG_PREFIX_DELETE)
+			{
+				if(!MatchesPrefixDelete(&log[j], key))
+					continue;
+			}
+			else if(memcmp(log[j].m_key, key, KVS_NAMELEN) != 0)
+				continue;
+
+			//Ignore anything corrupted
+			if((log[j].m_headerCRC != 0) && (HeaderCRC(&log[j]) != log[j].m_headerCRC) )
+				continue;
+			deleted = CheckDataCRC(m_active, &log[j]);
+		}
+
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::Compact: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			continue;
+		}
+
+		if(deleted)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+	@brief Checks if a log entry is superseded by a later valid entry for the same object, or by a later prefix delete
+
+	Only entries with a matching name (or prefix) have their CRCs checked.
+
+	@param bank		Bank to search
+	@param i		Index of the log entry to check
+	@param end		Index of the log entry after the last one to search
+ */
+bool KVS::IsSupersededAfter(StorageBank* bank, uint32_t i, uint32_t end)
+{
+	auto log = bank->GetLog();
+	auto key = log[i].m_key;
+	for(uint32_t j=i+1; j<end; j++)
+	{
+		m_eccFault = false;
+		bool superseded = false;
+
+		unsafe
+		{
+			if(log[j].m_flags & LogEntry::FLAG_PREFIX_DELETE)
+			{
+				if(MatchesPrefixDelete(&log[j], key))
+					superseded = (HeaderCRC(&log[j]) == log[j].m_headerCRC);
+			}
+
+			//Segments are part of the object they were appended to, not new revisions
+			else if( !(log[j].m_flags & LogEntry::FLAG_SEGMENT) && (memcmp(log[j].m_key, key, KVS_NAMELEN) == 0) )
+			{
+				superseded = ( (log[j].m_headerCRC == 0) || (HeaderCRC(&log[j]) == log[j].m_headerCRC) ) &&
+					CheckDataCRC(bank, &log[j]);
+			}
+		}
+
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::ExportSnapshot: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			continue;
+		}
+
+		if(superseded)
+			return true;
+	}
+
+	return false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -673,10 +4443,12 @@ bool KVS::Compact()
  */
 void KVS::WipeInactive()
 {
-	if(m_active == m_left)
-		m_right->Erase();
-	else
-		m_left->Erase();
+	FinishCompact();
+	auto inactive = GetInactiveBank();
+	WaitForReaders(inactive);
+	ClearChunkCache();
+	inactive->Erase();
+	m_inactiveBlank = false;
 }
 
 /**
@@ -687,8 +4459,14 @@ void KVS::WipeInactive()
  */
 void KVS::WipeAll()
 {
+	FinishCompact();
+	ClearChunkCache();
+	DropCachedWrites("", 0);
+	WaitForReaders(m_left);
 	m_left->Erase();
+	WaitForReaders(m_right);
 	m_right->Erase();
+	m_inactiveBlank = false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -700,27 +4478,167 @@ void KVS::WipeAll()
 	@param list Result buffer containing at least "size" entries
 	@param size	Number of entries in "list"
 
-	If the list is too small to contain all objects, the first "size" entries are written to "list" and the function
-	returns "size".
+	If the list is too small to contain all objects, the "size" entries with the lowest keys are written to "list"
+	and the function returns "size".
 
 	@return Number of objects written to "list"
  */
 uint32_t KVS::EnumObjects(KVSListEntry* list, uint32_t size)
+{
+	return EnumObjectsInternal(nullptr, nullptr, nullptr, list, size, nullptr);
+}
+
+/**
+	@brief Enumerates all objects whose name begins with a given prefix (e.g. "eth0.")
+
+	@param prefix	Name prefix to match. Only the first KVS_NAMELEN characters are significant.
+	@param list		Result buffer containing at least "size" entries
+	@param size		Number of entries in "list"
+	@param cursor	Optional cursor for paged listing. If non-null, enumeration starts after the last key returned by
+					the previous call with the same cursor, and the cursor is updated to point after this page.
+
+	@return Number of objects written to "list", in sorted key order
+ */
+uint32_t KVS::EnumObjectsPrefix(const char* prefix, KVSListEntry* list, uint32_t size, KVSEnumCursor* cursor)
+{
+	return EnumObjectsInternal(prefix, nullptr, nullptr, list, size, cursor);
+}
+
+/**
+	@brief Enumerates all objects whose name is within a range of keys
+
+	@param first	Lowest key to return (inclusive), or nullptr for no lower bound
+	@param last		Highest key to return (inclusive), or nullptr for no upper bound
+	@param list		Result buffer containing at least "size" entries
+	@param size		Number of entries in "list"
+	@param cursor	Optional cursor for paged listing, see EnumObjectsPrefix()
+
+	@return Number of objects written to "list", in sorted key order
+ */
+uint32_t KVS::EnumObjectsRange(
+	const char* first,
+	const char* last,
+	KVSListEntry* list,
+	uint32_t size,
+	KVSEnumCursor* cursor)
+{
+	return EnumObjectsInternal(nullptr, first, last, list, size, cursor);
+}
+
+/**
+	@brief Common implementation of all enumeration functions
+
+	The log is not sorted, so every call makes one pass over it. Keys outside the prefix, range, or cursor position are
+	rejected by a plain name comparison before any CRC is checked, so the expensive validation work is proportional to
+	the number of matching entries.
+
+	"list" is kept sorted as it is filled. Once it is full, a new key only displaces the highest key in the list, so the
+	result is always the "size" lowest matching keys and the cursor can resume exactly where this page stopped.
+ */
+uint32_t KVS::EnumObjectsInternal(
+	const char* prefix,
+	const char* first,
+	const char* last,
+	KVSListEntry* list,
+	uint32_t size,
+	KVSEnumCursor* cursor)
 {
 	m_eccFault = false;
 
+	if(cursor && cursor->m_done)
+		return 0;
+
+	//Convert bounds to zero padded keys
+	uint32_t prefixlen = 0;
+	if(prefix)
+		prefixlen = strnlen(prefix, KVS_NAMELEN);
+	char firstKey[KVS_NAMELEN] = {0};
+	char lastKey[KVS_NAMELEN] = {0};
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Wstringop-truncation"
+	if(first)
+		strncpy(firstKey, first, KVS_NAMELEN);
+	if(last)
+		strncpy(lastKey, last, KVS_NAMELEN);
+	#pragma GCC diagnostic pop
+
 	uint32_t ret = 0;
+	bool truncated = false;
 
 	//Start searching the log
-	auto len = m_active->GetHeader()->m_logSize;
-	auto base = m_active->GetLog();
+	KVSReadLock lock(this);
+	auto bank = lock.GetBank();
+	auto len = lock.GetLogEnd();
+	auto base = bank->GetLog();
 	for(uint32_t i=0; i<len; i++)
 	{
-		//If start address is blank, this log entry was never written.
+		//If start address and length are blank, this log entry was never written.
 		//We must be at the end of the log. Whatever we've found by this point is all there is to find.
-		if(base[i].m_start == BLANK_FLASH_X32)
+		if(IsLogEntryBlank(&base[i]))
 			break;
 
+		//A prefix delete marks everything it matches as deleted, just like a zero-length revision would
+		bool prefixDelete = false;
+		bool segment = false;
+		bool valid = false;
+		unsafe
+		{
+			prefixDelete = (base[i].m_flags & LogEntry::FLAG_PREFIX_DELETE);
+			segment = (base[i].m_flags & LogEntry::FLAG_SEGMENT);
+			if(prefixDelete)
+				valid = (HeaderCRC(&base[i]) == base[i].m_headerCRC);
+		}
+		if(m_eccFault)
+		{
+			m_eccFault = false;
+			g_log(Logger::WARNING, "KVS::EnumObjects: uncorrectable ECC error at address 0x%08x (pc=%08x)\n",
+				m_eccFaultAddr, m_eccFaultPC);
+			continue;
+		}
+		if(prefixDelete)
+		{
+			for(uint32_t j=0; valid && (j<ret); j++)
+			{
+				if(MatchesPrefixDelete(&base[i], list[j].key))
+					list[j].size = 0;
+			}
+			continue;
+		}
+
+		//Segments are already counted in the size of the object they were appended to
+		if(segment)
+			continue;
+
+		//Cheap filtering by name before doing anything else
+		auto key = base[i].m_key;
+		if(prefixlen && (memcmp(key, prefix, prefixlen) != 0) )
+			continue;
+		if(first && (KeyCompare(key, firstKey) < 0) )
+			continue;
+		if(last && (KeyCompare(key, lastKey) > 0) )
+			continue;
+		if(cursor && cursor->m_started && (KeyCompare(key, cursor->m_lastKey) <= 0) )
+			continue;
+
+		//Find where this key belongs in the output list
+		uint32_t pos = 0;
+		bool found = false;
+		for(; pos<ret; pos++)
+		{
+			int cmp = KeyCompare(key, list[pos].key);
+			if(cmp == 0)
+				found = true;
+			if(cmp <= 0)
+				break;
+		}
+
+		//If the list is full and everything in it is lower, we'll never return this key
+		if(!found && (pos == size) )
+		{
+			truncated = true;
+			continue;
+		}
+
 		unsafe
 		{
 			//Ignore anything with invalid header CRC
@@ -728,7 +4646,7 @@ uint32_t KVS::EnumObjects(KVSListEntry* list, uint32_t size)
 				continue;
 
 			//Ignore anything with an invalid CRC
-			if(m_active->CRC(m_active->GetBase() + base[i].m_start, base[i].m_len) != base[i].m_crc)
+			if(!CheckDataCRC(bank, &base[i]))
 				continue;
 		}
 
@@ -741,47 +4659,54 @@ uint32_t KVS::EnumObjects(KVSListEntry* list, uint32_t size)
 			continue;
 		}
 
-		//See if this object is already in the output list.
-		//If so, increment the number of copies and update the size (latest object is current)
-		bool found = false;
-		for(uint32_t j=0; j<ret; j++)
+		//If this object is already in the output list, increment the number of copies and update the size
+		//(latest object is current)
+		if(found)
 		{
-			if(memcmp(base[i].m_key, list[j].key, KVS_NAMELEN) == 0)
-			{
-				found = true;
-				list[j].size = base[i].m_len;
-				list[j].revs ++;
-				break;
-			}
+			list[pos].size = GetObjectSize(&base[i]);
+			list[pos].revs ++;
+			continue;
 		}
 
-		//If not found, add it
-		if(!found)
+		//Otherwise insert it, dropping the highest key if the list is already full
+		if(ret == size)
 		{
-			memcpy(list[ret].key, base[i].m_key, KVS_NAMELEN);
-			list[ret].key[KVS_NAMELEN] = '\0';
-			list[ret].size = base[i].m_len;
-			list[ret].revs = 1;
-			ret ++;
-			if(ret == size)
-				break;
+			truncated = true;
+			ret --;
 		}
+		memmove(&list[pos+1], &list[pos], (ret - pos) * sizeof(KVSListEntry));
+		memcpy(list[pos].key, key, KVS_NAMELEN);
+		list[pos].key[KVS_NAMELEN] = '\0';
+		list[pos].size = GetObjectSize(&base[i]);
+		list[pos].revs = 1;
+		ret ++;
+	}
+
+	//Save our position for the next page
+	if(cursor)
+	{
+		if(ret > 0)
+		{
+			memcpy(cursor->m_lastKey, list[ret-1].key, KVS_NAMELEN);
+			cursor->m_started = true;
+		}
+		if(!truncated)
+			cursor->m_done = true;
 	}
 
-	qsort(list, ret, sizeof(KVSListEntry), KVS::ListCompare);
 	return ret;
 }
 
-int KVS::ListCompare(const void* a, const void* b)
+/**
+	@brief Compares two keys, treating them as KVS_NAMELEN byte arrays which may not be null terminated
+ */
+int KVS::KeyCompare(const char* a, const char* b)
 {
-	auto pa = reinterpret_cast<const KVSListEntry*>(a);
-	auto pb = reinterpret_cast<const KVSListEntry*>(b);
-
 	for(int i=0; i<KVS_NAMELEN; i++)
 	{
-		if(pa->key[i] > pb->key[i])
+		if(a[i] > b[i])
 			return 1;
-		if(pa->key[i] < pb->key[i])
+		if(a[i] < b[i])
 			return -1;
 	}
 	return 0;
@@ -41,9 +41,124 @@
 #endif
 
 #include <stdint.h>
+#include <string.h>
 #include "../driver/StorageBank.h"
+#include "LZCodec.h"
 #include <embedded-utils/StringBuffer.h>
 
+#ifdef STM32L031
+#define BLANK_FLASH_BYTE 0x00
+#define BLANK_FLASH_X32 0x00000000
+#else
+#define BLANK_FLASH_BYTE 0xff
+#define BLANK_FLASH_X32 0xffffffff
+#endif
+
+//Minimum alignment (in bytes) of object content in the data area, so typed access to memory mapped objects is safe.
+//Must be a power of two, and the base address of each bank must be at least this aligned.
+//On block writable flash, objects are additionally aligned to MICROKVS_WRITE_BLOCK_SIZE.
+#ifndef MICROKVS_DATA_ALIGNMENT
+#define MICROKVS_DATA_ALIGNMENT 4
+#endif
+
+#if (MICROKVS_DATA_ALIGNMENT == 0) || ( (MICROKVS_DATA_ALIGNMENT & (MICROKVS_DATA_ALIGNMENT - 1)) != 0 )
+#error MICROKVS_DATA_ALIGNMENT must be a power of two
+#endif
+
+//Objects up to this size (in bytes) are stored in the log entry rather than the data area. Maximum 4, 0 to disable.
+#ifndef KVS_INLINE_MAX
+#define KVS_INLINE_MAX 4
+#endif
+
+#if KVS_INLINE_MAX > 4
+#error KVS_INLINE_MAX cannot be more than 4
+#endif
+
+//Size of the RAM buffer used when content is streamed to flash rather than written from one contiguous buffer.
+//Must be a multiple of the write block size.
+#ifndef KVS_STREAM_BUFFER_SIZE
+	#if defined(MICROKVS_WRITE_BLOCK_SIZE) && (MICROKVS_WRITE_BLOCK_SIZE > 64)
+		#define KVS_STREAM_BUFFER_SIZE MICROKVS_WRITE_BLOCK_SIZE
+	#else
+		#define KVS_STREAM_BUFFER_SIZE 64
+	#endif
+#endif
+
+//Number of recently written payloads remembered (by CRC) so identical content can be shared rather than written again.
+//Costs 4 bytes of RAM per entry. Set to 0 to disable deduplication.
+#ifndef KVS_DEDUP_TABLE_SIZE
+#define KVS_DEDUP_TABLE_SIZE 16
+#endif
+
+//Number of recently copied object names remembered during compaction, to avoid searching the output log for them
+#ifndef KVS_COMPACT_CACHE_SIZE
+#define KVS_COMPACT_CACHE_SIZE 16
+#endif
+
+//At startup, every Nth 32-bit word of the inactive bank is checked to see if it is still blank from a previous
+//PrepareInactiveBank() call. 1 checks every word; larger values boot faster but may miss stray programmed bits.
+//0 disables the check, so the inactive bank is always erased by the first compaction after a reboot.
+#ifndef KVS_BLANK_CHECK_STRIDE
+#define KVS_BLANK_CHECK_STRIDE 1
+#endif
+
+//Number of times a counter can be incremented in place before a new revision of it has to be written.
+//Each increment uses one bit, or one write block if MICROKVS_WRITE_BLOCK_SIZE is set.
+#ifndef KVS_COUNTER_INCREMENTS
+	#ifdef MICROKVS_WRITE_BLOCK_SIZE
+		#define KVS_COUNTER_INCREMENTS 32
+	#else
+		#define KVS_COUNTER_INCREMENTS 256
+	#endif
+#endif
+
+//Number of times an object written by StoreRewritableObject() can be updated in place before a new revision of it has
+//to be written. Each costs 4 bytes of data space.
+#ifndef KVS_REWRITE_SLOTS
+#define KVS_REWRITE_SLOTS 8
+#endif
+
+//Maximum number of delta revisions written by StoreDeltaObject() on top of a full copy of an object.
+//Reading an object walks its whole chain, so this bounds the cost of reads.
+#ifndef KVS_DELTA_CHAIN_MAX
+#define KVS_DELTA_CHAIN_MAX 4
+#endif
+
+//Size of the chunks of an object written by StoreChunkedObject() which are checked independently.
+//Each costs 4 bytes of data space.
+#ifndef KVS_CHUNK_SIZE
+#define KVS_CHUNK_SIZE 256
+#endif
+
+//Number of chunked objects for which the chunks already checked are remembered, and the number of chunks remembered
+//for each (the rest are checked on every read). Not available with MICROKVS_CONCURRENT_READERS, since readers would
+//race to update it.
+#ifndef KVS_CHUNK_CACHE_SIZE
+	#ifdef MICROKVS_CONCURRENT_READERS
+		#define KVS_CHUNK_CACHE_SIZE 0
+	#else
+		#define KVS_CHUNK_CACHE_SIZE 2
+	#endif
+#endif
+#ifndef KVS_CHUNK_CACHE_CHUNKS
+#define KVS_CHUNK_CACHE_CHUNKS 64
+#endif
+
+//Maximum number of objects looked up in a single pass over the log by ReadObjects(). Larger batches take several
+//passes. Costs 1 byte plus a pointer of stack per entry, must be less than 256.
+#ifndef KVS_BATCH_SIZE
+#define KVS_BATCH_SIZE 32
+#endif
+
+#if KVS_BATCH_SIZE > 255
+#error KVS_BATCH_SIZE must be less than 256
+#endif
+
+//Largest object which can be held in the write cache by StoreObjectDeferred(). Larger ones are written immediately.
+#ifndef KVS_WRITE_CACHE_OBJECT_MAX
+#define KVS_WRITE_CACHE_OBJECT_MAX 16
+#endif
+
 /**
 	@brief A list entry used for enumerating the content of the KVS
  */
@@ -51,16 +166,197 @@ struct KVSListEntry
 {
 	char key[KVS_NAMELEN+1];	//[KVS_NAMELEN] is always null for easy printing
 								//even if original key is not null terminated
-	uint32_t size;				//Size of the most recent copy of the object
+	uint32_t size;				//Size of the most recent copy of the object (uncompressed)
 	uint32_t revs;				//Number of copies (including the current one) stored in the current erase block
 };
 
+/**
+	@brief Resumption point for paged enumeration
+
+	Filtered enumeration returns objects in sorted key order. The cursor remembers the last key returned, so the next
+	call with the same cursor continues with the following key. Keys created or deleted between calls are picked up
+	(or skipped) as appropriate, since each call rescans the current log.
+ */
+struct KVSEnumCursor
+{
+	KVSEnumCursor()
+	{ Reset(); }
+
+	///@brief Restarts enumeration from the first key
+	void Reset()
+	{
+		memset(m_lastKey, 0, sizeof(m_lastKey));
+		m_started = false;
+		m_done = false;
+	}
+
+	///@brief Returns true once the last page has been returned
+	bool IsDone()
+	{ return m_done; }
+
+	char m_lastKey[KVS_NAMELEN];	//Last key returned to the caller
+	bool m_started;					//True if m_lastKey is valid
+	bool m_done;					//True if no keys remain after m_lastKey
+};
+
+/**
+	@brief Cached result of looking up an object by name
+
+	A handle remembers where the current version of an object was last found. Looking the object up again through the
+	handle only searches log entries written since then, unless the store has been compacted in the meantime. This
+	makes repeated access to frequently used objects much cheaper than looking them up by name each time.
+
+	The lookup is done lazily the first time the handle is used.
+ */
+class KVSHandle
+{
+public:
+	explicit KVSHandle(const char* name)
+	: m_log(nullptr)
+	, m_bank(nullptr)
+	, m_version(0)
+	, m_logEnd(0)
+	{
+		memset(m_key, 0, sizeof(m_key));
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wstringop-truncation"
+		strncpy(m_key, name, KVS_NAMELEN);
+		#pragma GCC diagnostic pop
+	}
+
+	///@brief Returns the name of the object
+	const char* GetName()
+	{ return m_key; }
+
+protected:
+	friend class KVS;
+
+	char m_key[KVS_NAMELEN+1];		//[KVS_NAMELEN] is always null
+	LogEntry* m_log;				//Latest valid log entry (possibly a deletion) as of m_logEnd, or null
+	StorageBank* m_bank;			//Bank which was searched
+	uint32_t m_version;				//Version of m_bank when it was searched
+	uint32_t m_logEnd;				//Number of log entries in m_bank which have been searched
+};
+
+/**
+	@brief A position in the history of the store, for finding out what changed since then
+
+	Since the log is append-only, everything written since a given log index in a given bank version is exactly the set
+	of changes since that point. Compaction starts a new bank version, invalidating all cursors for the old one.
+	Cursors remain valid across reboots, so they can be stored by a remote mirror.
+ */
+struct KVSChangeCursor
+{
+	uint32_t m_version;		//Version number of the bank
+	uint32_t m_logIndex;	//Index of the next log entry to report
+};
+
+/**
+	@brief Compiled-in default for an object (see KVS::SetDefaults)
+ */
+struct KVSDefault
+{
+	const char* m_name;			//Name of the object
+	const void* m_data;			//Content read when the object doesn't exist
+	uint32_t m_len;				//Size of m_data
+};
+
+/**
+	@brief One object to be read by KVS::ReadObjects()
+ */
+struct KVSBatchRead
+{
+	const char* m_name;			//Name of the object
+	uint8_t* m_data;			//Output buffer
+	uint32_t m_len;				//Size of the output buffer
+	const uint8_t* m_default;	//Copied to the output buffer (m_len bytes) if the object can't be read, or null
+	bool m_found;				//Set by ReadObjects() to true if the object was found and read
+};
+
+class KVS;
+struct KVSPatch;
+
+/**
+	@brief Callback invoked when a watched object is modified
+
+	@param kvs		The store which was modified
+	@param log		The new log entry. m_len is zero if the object was deleted, and FLAG_PREFIX_DELETE is set in m_flags
+					if it was deleted by DeletePrefix() (m_key is then the deleted prefix, not the watched name).
+	@param param	Argument passed when the watch was registered
+ */
+typedef void (*KVSWatchCallback)(KVS* kvs, LogEntry* log, void* param);
+
+/**
+	@brief A single registration in the watch table (see KVS::SetWatchTable)
+ */
+struct KVSWatch
+{
+	char m_key[KVS_NAMELEN];		//Name or prefix being watched
+	uint32_t m_keyLen;				//Number of significant bytes in m_key (KVS_NAMELEN for an exact name)
+	KVSWatchCallback m_callback;	//Callback to invoke, or null if this slot is free
+	void* m_param;					//Argument for m_callback
+};
+
+/**
+	@brief A single object held in the write cache (see KVS::SetWriteCache)
+ */
+struct KVSCachedWrite
+{
+	char m_key[KVS_NAMELEN];						//Name of the object
+	uint8_t m_data[KVS_WRITE_CACHE_OBJECT_MAX];		//Latest content of the object
+	uint32_t m_len;									//Size of the latest content
+	uint32_t m_time;								//Time at which the object first differed from flash
+	bool m_dirty;									//True if this slot holds content not yet written to flash
+};
+
+/**
+	@brief Read side critical section for concurrent access to a KVS
+
+	While a KVSReadLock is held, the bank it was taken on (and thus any pointer returned by FindObject or MapObject
+	in the meantime) will not be erased by a compaction. Locks may be nested.
+
+	If MICROKVS_CONCURRENT_READERS is not defined this is a no-op, so code can use it unconditionally.
+ */
+class KVSReadLock
+{
+public:
+	KVSReadLock(KVS* kvs);
+
+	#ifdef MICROKVS_CONCURRENT_READERS
+	~KVSReadLock();
+	#endif
+
+	///@brief Returns the bank which was active when the lock was taken
+	StorageBank* GetBank();
+
+	///@brief Returns the number of log entries which were committed when the lock was taken
+	uint32_t GetLogEnd();
+
+protected:
+	KVS* m_kvs;
+
+	#ifdef MICROKVS_CONCURRENT_READERS
+	uint32_t m_snapshot;
+	#endif
+};
+
 /**
 	@brief Top level KVS object
+
+	By default the KVS is not thread safe. If MICROKVS_CONCURRENT_READERS is defined, any number of threads may call
+	the read API (FindObject, MapObject, ReadObject, EnumObjects) concurrently with a single writer thread, without
+	locking. Readers see a published snapshot of the active bank and log, and compaction waits for readers of the old
+	bank to finish before erasing it. Pointers returned by FindObject / MapObject are only guaranteed valid while the
+	calling thread holds a KVSReadLock. The writer must not hold a KVSReadLock while storing or compacting.
+
+	Concurrent mode uses GCC __atomic builtins; on cores without atomic read-modify-write instructions (e.g.
+	Cortex-M0) these must be provided by libatomic or equivalent.
  */
 class KVS
 {
 public:
+	friend class KVSReadLock;
+
 	KVS(StorageBank* left, StorageBank* right, uint32_t defaultLogSize);
 
 	/**
@@ -82,6 +378,7 @@ public:
 
 	//Main API
 	LogEntry* FindObject(const char* name);
+	LogEntry* FindObject(KVSHandle& handle);
 
 	/**
 		@brief Wrapper around FindObject with sprintf-style formatting
@@ -100,9 +397,85 @@ public:
 	}
 
 	uint8_t* MapObject(LogEntry* log);
+	uint32_t GetObjectSize(LogEntry* log);
 	bool ReadObject(const char* name, uint8_t* data, uint32_t len);
+	bool ReadObject(LogEntry* log, uint8_t* data, uint32_t len);
+	bool ReadObject(KVSHandle& handle, uint8_t* data, uint32_t len);
+	bool ReadObjectRange(const char* name, uint32_t offset, uint8_t* data, uint32_t len);
+	bool ReadObjectRange(LogEntry* log, uint32_t offset, uint8_t* data, uint32_t len);
+	bool VerifyObjectRange(LogEntry* log, uint32_t offset, uint32_t len);
+	uint32_t ReadObjects(KVSBatchRead* reads, uint32_t count);
 
 	bool StoreObject(const char* name, const uint8_t* data, uint32_t len);
+	bool StoreObject(KVSHandle& handle, const uint8_t* data, uint32_t len);
+	bool StoreCompressedObject(const char* name, const uint8_t* data, uint32_t len);
+	bool StoreDeltaObject(const char* name, const uint8_t* data, uint32_t len);
+	bool PatchObject(const char* name, uint32_t offset, const uint8_t* data, uint32_t len);
+	bool AppendObject(const char* name, const uint8_t* data, uint32_t len);
+	LogEntry* GetNextSegment(LogEntry* log);
+	bool StoreRewritableObject(const char* name, const uint8_t* data, uint32_t len);
+	bool StoreChunkedObject(const char* name, const uint8_t* data, uint32_t len);
+	bool StoreCounter(const char* name, uint32_t value);
+	bool IncrementCounter(const char* name);
+	bool DeleteObject(const char* name);
+	bool DeletePrefix(const char* prefix);
+
+	//Incremental sync
+
+	///@brief Result of GetNextChange()
+	enum ChangeStatus
+	{
+		CHANGE_FOUND,
+		CHANGE_NONE,
+		CHANGE_CURSOR_INVALID
+	};
+
+	KVSChangeCursor GetChangeCursor();
+	ChangeStatus GetNextChange(KVSChangeCursor& cursor, LogEntry*& log);
+
+	//Optimistic concurrency
+
+	///@brief Result of StoreObjectIfRevision()
+	enum RevisionStatus
+	{
+		REVISION_STORED,		//the new content was written
+		REVISION_CHANGED,		//the object was written or the store compacted since; re-read and try again
+		REVISION_BUSY,			//another thread was storing a revision at the same time; try again
+		REVISION_UNSUPPORTED,	//the object is a counter or rewritable, whose updates don't change the revision
+		REVISION_FAILED			//the write failed
+	};
+
+	uint64_t GetRevision(const char* name);
+	uint64_t GetRevision(LogEntry* log);
+	RevisionStatus StoreObjectIfRevision(
+		const char* name,
+		uint64_t expectedRevision,
+		const uint8_t* data,
+		uint32_t len);
+
+	//Backup and restore
+	bool ExportSnapshot(KVSByteSink* sink);
+	bool ImportSnapshot(KVSByteSource* source);
+
+	//Compiled-in defaults
+	bool SetDefaults(const KVSDefault* table, uint32_t size, uint32_t* overridden);
+	const KVSDefault* GetDefault(const char* name);
+
+	//Write-back caching
+	bool SetWriteCache(KVSCachedWrite* table, uint32_t size, uint32_t maxAge, uint32_t maxDirtyBytes);
+	bool StoreObjectDeferred(const char* name, const uint8_t* data, uint32_t len, uint32_t now);
+	bool FlushExpired(uint32_t now);
+	bool Flush();
+
+	///@brief Returns the number of bytes of content in the write cache which haven't been written to flash yet
+	uint32_t GetDirtyBytes()
+	{ return m_dirtyBytes; }
+
+	//Change notification
+	void SetWatchTable(KVSWatch* table, uint32_t size);
+	bool Watch(const char* name, KVSWatchCallback callback, void* param);
+	bool WatchPrefix(const char* prefix, KVSWatchCallback callback, void* param);
+	void Unwatch(KVSWatchCallback callback, void* param);
 
 	/**
 		@brief Wrapper around StoreObject with sprintf-style formatting
@@ -120,13 +493,44 @@ public:
 		return StoreObject(objname, data, len);
 	}
 
+	///@brief Status of an operation which runs asynchronously
+	enum AsyncStatus
+	{
+		ASYNC_BUSY,
+		ASYNC_DONE,
+		ASYNC_FAILED
+	};
+
 	//Maintenance operations
 	bool Compact();
+	bool StartCompact();
+	AsyncStatus PollCompact();
+	bool FinishCompact();
+	bool PrepareInactiveBank();
+
+	///@brief Returns true if a compaction started by StartCompact() is still in progress
+	bool IsCompacting()
+	{ return m_compactState != COMPACT_IDLE; }
+
+	///@brief Returns true if the inactive bank is known to be blank, so the next compaction can skip erasing it
+	bool IsInactiveBankPrepared()
+	{ return m_inactiveBlank; }
 	void WipeInactive();
 	void WipeAll();
 
 	//Enumeration
 	uint32_t EnumObjects(KVSListEntry* list, uint32_t size);
+	uint32_t EnumObjectsPrefix(
+		const char* prefix,
+		KVSListEntry* list,
+		uint32_t size,
+		KVSEnumCursor* cursor = nullptr);
+	uint32_t EnumObjectsRange(
+		const char* first,
+		const char* last,
+		KVSListEntry* list,
+		uint32_t size,
+		KVSEnumCursor* cursor = nullptr);
 
 	/**
 		@brief Reads a value from the KVS, returning a default value if not found
@@ -134,11 +538,40 @@ public:
 	template<class T>
 	T ReadObject(const char* name, T defaultValue)
 	{
+		auto cached = FindCachedWrite(name);
+		if(cached)
+		{
+			memcpy(&defaultValue, cached->m_data, (cached->m_len < sizeof(T)) ? cached->m_len : sizeof(T));
+			return defaultValue;
+		}
+
+		KVSReadLock lock(this);
 		auto hlog = FindObject(name);
 		if(hlog)
-			return *reinterpret_cast<const T*>(MapObject(hlog));
+			return ReadValue<T>(hlog, defaultValue);
 		else
+			return ReadDefault<T>(name, defaultValue);
+	}
+
+	/**
+		@brief Reads a value from the KVS using a handle, returning a default value if not found
+	 */
+	template<class T>
+	T ReadObject(KVSHandle& handle, T defaultValue)
+	{
+		auto cached = FindCachedWrite(handle.GetName());
+		if(cached)
+		{
+			memcpy(&defaultValue, cached->m_data, (cached->m_len < sizeof(T)) ? cached->m_len : sizeof(T));
 			return defaultValue;
+		}
+
+		KVSReadLock lock(this);
+		auto hlog = FindObject(handle);
+		if(hlog)
+			return ReadValue<T>(hlog, defaultValue);
+		else
+			return ReadDefault<T>(handle.GetName(), defaultValue);
 	}
 
 	/**
@@ -169,20 +602,29 @@ public:
 	template<class T>
 	bool StoreObjectIfNecessary(const char* name, T currentValue, T defaultValue)
 	{
+		//If there's a deferred write pending, that's the current value
+		auto cached = FindCachedWrite(name);
+		if(cached)
+		{
+			if( (cached->m_len == sizeof(currentValue)) && (memcmp(cached->m_data, &currentValue, sizeof(currentValue)) == 0) )
+				return true;
+			return StoreObject(name, (const uint8_t*)&currentValue, sizeof(currentValue));
+		}
+
 		//See if the value is already there
 		auto hlog = FindObject(name);
 
 		//If not found: write if non-default
 		if(!hlog)
 		{
-			if(currentValue != defaultValue)
+			if(currentValue != ReadDefault<T>(name, defaultValue))
 				return StoreObject(name, (const uint8_t*)&currentValue, sizeof(currentValue));
 		}
 
 		//If found: write if changed
 		else
 		{
-			if(currentValue != *reinterpret_cast<const T*>(MapObject(hlog)))
+			if(currentValue != ReadValue<T>(hlog, currentValue))
 				return StoreObject(name, (const uint8_t*)&currentValue, sizeof(currentValue));
 		}
 		return true;
@@ -268,17 +710,155 @@ public:
 		return val;
 	}
 
+	///@brief Rounds a data area offset up to the next position an object may start at
+	uint32_t RoundUpToDataAlignment(uint32_t val)
+	{
+		val = RoundUpToWriteBlockSize(val);
+		return (val + (MICROKVS_DATA_ALIGNMENT - 1)) & ~(MICROKVS_DATA_ALIGNMENT - 1);
+	}
+
 	uint32_t HeaderCRC(const LogEntry* log);
 
+	#ifdef MICROKVS_CONCURRENT_READERS
+	uint32_t ReadLock();
+	void ReadUnlock(uint32_t snapshot);
+	#endif
+
 protected:
-	bool StoreObjectInternal(const char* name, const uint8_t* data, uint32_t len);
+
+	/**
+		@brief Reads a value from a log entry, mapping it directly if possible
+	 */
+	template<class T>
+	T ReadValue(LogEntry* hlog, T defaultValue)
+	{
+		auto p = MapObject(hlog);
+		if(p)
+		{
+			//Object content is always aligned to MICROKVS_DATA_ALIGNMENT, so this is safe for most types
+			if constexpr(alignof(T) <= MICROKVS_DATA_ALIGNMENT)
+				return *reinterpret_cast<const T*>(p);
+
+			T value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		//Not mappable (compressed), decompress to a temporary
+		T value = defaultValue;
+		ReadObject(hlog, reinterpret_cast<uint8_t*>(&value), sizeof(value));
+		return value;
+	}
+
+	/**
+		@brief Returns the compiled-in default for an object if it has one of the right size, otherwise defaultValue
+	 */
+	template<class T>
+	T ReadDefault(const char* name, T defaultValue)
+	{
+		auto def = GetDefault(name);
+		if(!def || (def->m_len != sizeof(T)) )
+			return defaultValue;
+
+		T value;
+		memcpy(&value, def->m_data, sizeof(value));
+		return value;
+	}
+
+	KVSCachedWrite* FindCachedWrite(const char* name);
+	void DropCachedWrites(const char* key, uint32_t keylen);
+
+	int32_t FindDefaultIndex(const char* name);
+	void MarkOverridden(const char* key);
+	void UpdateOverrides();
+
+	///@brief Returns true if the object with the given index in m_defaults might exist in the active bank
+	bool IsOverridden(int32_t index)
+	{
+		#ifdef MICROKVS_CONCURRENT_READERS
+			return (__atomic_load_n(&m_overridden[index / 32], __ATOMIC_SEQ_CST) & (1u << (index % 32))) != 0;
+		#else
+			return (m_overridden[index / 32] & (1u << (index % 32))) != 0;
+		#endif
+	}
+
+	bool StoreObjectInternal(
+		const char* name,
+		const uint8_t* data,
+		uint32_t len,
+		uint32_t flags = 0,
+		const KVSPatch* patch = nullptr);
+	bool GeneratePatch(const KVSPatch* patch, const uint8_t* data, uint32_t len, KVSByteSink* sink, uint32_t first = 0);
 
 	void FindCurrentBank();
 	void ScanCurrentBank();
 
-	static int ListCompare(const void* a, const void* b);
+	StorageBank* GetBankContaining(const void* ptr);
+	void PublishSnapshot();
+	bool HasReaders(StorageBank* bank);
+	void WaitForReaders(StorageBank* bank);
+
+	bool CompactScan();
+	AsyncStatus AbortCompact();
+
+	StorageBank* GetInactiveBank()
+	{ return (m_active == m_left) ? m_right : m_left; }
+
+	bool IsBankBlank(StorageBank* bank, uint32_t stride);
+
+	bool CheckDataCRC(StorageBank* bank, const LogEntry* log);
+
+	///@brief Returns true if a log entry has never been written
+	bool IsLogEntryBlank(const LogEntry* log)
+	{ return (log->m_start == BLANK_FLASH_X32) && (log->m_len == BLANK_FLASH_X32); }
+
+	///@brief Returns true if "key" starts with the prefix deleted by a FLAG_PREFIX_DELETE log entry
+	bool MatchesPrefixDelete(const LogEntry* log, const char* key)
+	{ return (log->m_start <= KVS_NAMELEN) && (memcmp(log->m_key, key, log->m_start) == 0); }
+
+	bool IsDeletedAfter(int64_t i);
+	bool IsSupersededAfter(StorageBank* bank, uint32_t i, uint32_t end);
+
+	bool RewriteInPlace(LogEntry* log, const uint8_t* data, uint32_t len);
+	bool GetContentCRC(LogEntry* log, uint32_t& crc);
+	bool CompactWriteChunk();
+
+	LogEntry* FindDeltaBase(StorageBank* bank, uint32_t index, const char* key);
+	bool EncodeDelta(LogEntry* base, const uint8_t* data, uint32_t len, KVSByteSink* sink);
+	bool ReadRange(StorageBank* bank, LogEntry* log, uint32_t offset, uint8_t* data, uint32_t len);
+
+	uint32_t GetCounterIncrements(StorageBank* bank, const LogEntry* log);
+	uint32_t GetCounterValue(StorageBank* bank, const LogEntry* log);
+
+	bool AddWatch(const char* name, uint32_t keylen, KVSWatchCallback callback, void* param);
+	void NotifyWatchers(LogEntry* log, const char* key, uint32_t keylen);
+
+	LogEntry* FindObjectInRange(StorageBank* bank, const char* key, uint32_t first, uint32_t end, LogEntry* log);
+
+	static int KeyCompare(const char* a, const char* b);
+
+	uint32_t EnumObjectsInternal(
+		const char* prefix,
+		const char* first,
+		const char* last,
+		KVSListEntry* list,
+		uint32_t size,
+		KVSEnumCursor* cursor);
+
+	void ClearDedupTable();
+	void ClearChunkCache();
+	uint32_t* GetChunkCache(const LogEntry* log);
+	void AddToDedupTable(uint32_t crc, uint32_t logindex);
+	bool FindDuplicatePayload(
+		const uint8_t* data,
+		uint32_t len,
+		uint32_t storedLen,
+		uint32_t flags,
+		uint32_t crc,
+		uint32_t& start);
 
 	bool InitializeBank(StorageBank* bank);
+	bool MigrateLegacyBank(StorageBank* src, StorageBank* dst);
 
 	///@brief First storage bank ("left")
 	StorageBank* m_left;
@@ -298,6 +878,134 @@ protected:
 	///@brief Offset (from start of block) of the first free data byte
 	uint32_t m_firstFreeData;
 
+	#if KVS_DEDUP_TABLE_SIZE > 0
+	///@brief Log entry index + 1 (0 = empty) of the most recent payload seen with each CRC value, modulo table size
+	uint32_t m_dedupTable[KVS_DEDUP_TABLE_SIZE];
+	#endif
+
+	#if KVS_CHUNK_CACHE_SIZE > 0
+	///@brief Log entry of a chunked object, and a bitmap of which of its chunks have been checked
+	struct ChunkCacheEntry
+	{
+		const LogEntry*	m_log;
+		uint32_t		m_verified[(KVS_CHUNK_CACHE_CHUNKS + 31) / 32];
+	};
+
+	///@brief Chunked objects whose chunks were recently checked. Cleared whenever a bank is erased.
+	ChunkCacheEntry m_chunkCache[KVS_CHUNK_CACHE_SIZE];
+
+	///@brief Index of the m_chunkCache entry to replace next
+	uint32_t m_nextChunkCache;
+	#endif
+
+	///@brief States of the compaction state machine
+	enum CompactState
+	{
+		COMPACT_IDLE,
+		COMPACT_WAIT_READERS,
+		COMPACT_ERASING,
+		COMPACT_SCAN,
+		COMPACT_WRITE_DATA,
+		COMPACT_WRITE_LOG,
+		COMPACT_WRITE_HEADER
+	};
+
+	///@brief Current state of the compaction in progress, if any
+	CompactState m_compactState;
+
+	///@brief Bank being compacted into
+	StorageBank* m_compactTarget;
+
+	///@brief Index of the next log entry in the active bank to consider copying (counts down)
+	int64_t m_compactIndex;
+
+	///@brief Index of the last deletion (zero-length or prefix delete entry) in the active bank, or -1 if none
+	int64_t m_compactLastDelete;
+
+	///@brief Index of the next free log entry in m_compactTarget
+	uint32_t m_compactNextLog;
+
+	///@brief Offset of the next free data byte in m_compactTarget
+	uint32_t m_compactNextData;
+
+	///@brief Names of recently copied objects
+	char m_compactCache[KVS_COMPACT_CACHE_SIZE][KVS_NAMELEN];
+
+	///@brief Next slot in m_compactCache to overwrite
+	uint32_t m_compactNextCache;
+
+	///@brief Log entry currently being written to m_compactTarget
+	LogEntry m_compactEntry;
+
+	///@brief Bank header being written to m_compactTarget
+	BankHeader m_compactHeader;
+
+	///@brief Folded value of the counter being written to m_compactTarget
+	uint32_t m_compactCounter;
+
+	///@brief Object being rebuilt into m_compactTarget: next segment of an appendable object, or a delta revision
+	LogEntry* m_compactSource;
+
+	///@brief Number of bytes of m_compactSource already copied
+	uint32_t m_compactSourcePos;
+
+	///@brief Number of bytes of the object being rebuilt which are still to be written
+	uint32_t m_compactRemaining;
+
+	///@brief Offset in m_compactTarget at which to write the next chunk of the object being rebuilt
+	uint32_t m_compactWritePos;
+
+	///@brief Staging buffer for rebuilding appendable and delta objects
+	uint8_t m_compactBuf[KVS_STREAM_BUFFER_SIZE];
+
+	///@brief True if the inactive bank has been verified blank since it was last written to
+	bool m_inactiveBlank;
+
+	#ifdef MICROKVS_CONCURRENT_READERS
+	/**
+		@brief State published to readers
+
+		Bit 31 is set if the right bank is active, bits 30:0 are the number of log entries readers may look at.
+	 */
+	uint32_t m_snapshot;
+
+	///@brief Number of readers currently using the left (0) and right (1) banks
+	uint32_t m_readers[2];
+
+	///@brief Set while a thread is in StoreObjectIfRevision()
+	bool m_revisionWriter;
+	#endif
+
+	///@brief Caller-provided table of watch registrations
+	KVSWatch* m_watches;
+
+	///@brief Number of entries in m_watches
+	uint32_t m_watchTableSize;
+
+	///@brief Caller-provided write cache
+	KVSCachedWrite* m_writeCache;
+
+	///@brief Number of entries in m_writeCache
+	uint32_t m_writeCacheSize;
+
+	///@brief Longest time an object may stay in m_writeCache without being written to flash
+	uint32_t m_writeCacheMaxAge;
+
+	///@brief Largest total size of objects in m_writeCache not yet written to flash
+	uint32_t m_writeCacheMaxDirty;
+
+	///@brief Total size of objects in m_writeCache not yet written to flash
+	uint32_t m_dirtyBytes;
+
+	///@brief Caller-provided table of compiled-in defaults, sorted by name
+	const KVSDefault* m_defaults;
+
+	///@brief Number of entries in m_defaults
+	uint32_t m_defaultsSize;
+
+	///@brief Caller-provided bitmap of entries in m_defaults which might exist in the active bank
+	uint32_t* m_overridden;
+
 	///@brief Error flag thrown from NMI/fault handler
 	volatile bool m_eccFault;
 
@@ -308,6 +1016,51 @@ protected:
 	volatile uint32_t m_eccFaultPC;
 };
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// KVSReadLock inline methods (need the full KVS declaration)
+
+#ifdef MICROKVS_CONCURRENT_READERS
+
+inline KVSReadLock::KVSReadLock(KVS* kvs)
+	: m_kvs(kvs)
+	, m_snapshot(kvs->ReadLock())
+{
+}
+
+inline KVSReadLock::~KVSReadLock()
+{
+	m_kvs->ReadUnlock(m_snapshot);
+}
+
+inline StorageBank* KVSReadLock::GetBank()
+{
+	return (m_snapshot & 0x80000000) ? m_kvs->m_right : m_kvs->m_left;
+}
+
+inline uint32_t KVSReadLock::GetLogEnd()
+{
+	return m_snapshot & 0x7fffffff;
+}
+
+#else
+
+inline KVSReadLock::KVSReadLock(KVS* kvs)
+	: m_kvs(kvs)
+{
+}
+
+inline StorageBank* KVSReadLock::GetBank()
+{
+	return m_kvs->m_active;
+}
+
+inline uint32_t KVSReadLock::GetLogEnd()
+{
+	return m_kvs->m_firstFreeLogEntry;
+}
+
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Helper macro to disable data faults (but only if we have flash ECC)
 
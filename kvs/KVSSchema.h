@@ -0,0 +1,252 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* microkvs                                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2021-2024 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author	Andrew D. Zonenberg
+	@brief	Declaration of KVSSetting and KVSSchema
+ */
+
+#ifndef KVSSchema_h
+#define KVSSchema_h
+
+#include "KVS.h"
+
+/**
+	@brief A setting known at compile time: the name of the object it's stored in, its type, and its default value
+
+	Settings must be declared constexpr, so they can be used as KVSSchema template arguments:
+
+		constexpr KVSSetting<uint16_t> g_httpPort("http.port", 80);
+ */
+template<class T>
+class KVSSetting
+{
+public:
+	static_assert(__is_trivially_copyable(T), "Settings must be trivially copyable");
+
+	constexpr KVSSetting(const char* name, T defaultValue)
+	: m_name(name)
+	, m_default(defaultValue)
+	{}
+
+	const char* m_name;
+	T m_default;
+};
+
+/**
+	@brief Compile time layout of a KVSSchema
+
+	This is separate from KVSSchema so it's complete, and usable in constant expressions, while KVSSchema is declared.
+ */
+template<const auto&... Settings>
+class KVSSchemaLayout
+{
+public:
+	///@brief Number of settings
+	static constexpr uint32_t COUNT = sizeof...(Settings);
+
+	/**
+		@brief Returns the slot index of a setting, or COUNT if it's not in the schema
+	 */
+	template<const auto& Setting>
+	static constexpr uint32_t IndexOf()
+	{
+		const void* settings[] = {&Settings...};
+		for(uint32_t i=0; i<COUNT; i++)
+		{
+			if(settings[i] == &Setting)
+				return i;
+		}
+		return COUNT;
+	}
+
+	/**
+		@brief Returns the offset of a setting in the RAM copy, aligned for its type
+	 */
+	template<const auto& Setting>
+	static constexpr uint32_t OffsetOf()
+	{
+		const uint32_t sizes[] = {sizeof(Settings.m_default)...};
+		const uint32_t aligns[] = {alignof(decltype(Settings.m_default))...};
+
+		uint32_t offset = 0;
+		for(uint32_t i=0; i<=IndexOf<Setting>(); i++)
+		{
+			offset = (offset + aligns[i] - 1) & ~(aligns[i] - 1);
+			if(i == IndexOf<Setting>())
+				break;
+			offset += sizes[i];
+		}
+		return offset;
+	}
+
+	///@brief Returns the total size of the RAM copy
+	static constexpr uint32_t Size()
+	{
+		const uint32_t ends[] = {OffsetOf<Settings>() + sizeof(Settings.m_default)...};
+		uint32_t size = 0;
+		for(auto end : ends)
+		{
+			if(end > size)
+				size = end;
+		}
+		return size;
+	}
+
+	///@brief Returns true if every name is non-empty and fits in a key
+	static constexpr bool NamesFit()
+	{
+		const char* names[] = {Settings.m_name...};
+		for(auto name : names)
+		{
+			uint32_t len = 0;
+			while(name[len])
+				len ++;
+			if( (len == 0) || (len > KVS_NAMELEN) )
+				return false;
+		}
+		return true;
+	}
+
+	///@brief Returns true if no two settings have the same name
+	static constexpr bool NamesUnique()
+	{
+		const char* names[] = {Settings.m_name...};
+		for(uint32_t i=0; i<COUNT; i++)
+		{
+			for(uint32_t j=i+1; j<COUNT; j++)
+			{
+				uint32_t k = 0;
+				while( names[i][k] && (names[i][k] == names[j][k]) )
+					k ++;
+				if(names[i][k] == names[j][k])
+					return false;
+			}
+		}
+		return true;
+	}
+};
+
+/**
+	@brief RAM copy of a fixed set of settings, with typed access by setting rather than by name
+
+		KVSSchema<g_httpPort, g_ipAddress> config(&kvs);
+		config.Load();
+		uint16_t port = config.Get<g_httpPort>();
+
+	Names that are too long for KVS_NAMELEN, and settings which share a name, are compile time errors. Each setting has
+	a fixed offset into the RAM copy, so Get() is a memcpy. Load() reads every setting with one pass over the log
+	(per KVS_BATCH_SIZE settings), and should be called at startup, and after anything other than Set() writes one of
+	the objects (including ImportSnapshot()).
+ */
+template<const auto&... Settings>
+class KVSSchema
+{
+public:
+	typedef KVSSchemaLayout<Settings...> Layout;
+
+	static_assert(Layout::COUNT > 0, "Schema has no settings");
+	static_assert(Layout::NamesFit(), "Setting name is empty or longer than KVS_NAMELEN");
+	static_assert(Layout::NamesUnique(), "Two settings have the same name");
+
+	KVSSchema(KVS* kvs)
+	: m_kvs(kvs)
+	{
+		LoadDefaults();
+	}
+
+	/**
+		@brief Reads every setting from the KVS, using the default for any which don't exist
+
+		@return Number of settings found in the KVS
+	 */
+	uint32_t Load()
+	{
+		LoadDefaults();
+		KVSBatchRead reads[] =
+		{
+			{
+				Settings.m_name,
+				m_values + Layout::template OffsetOf<Settings>(),
+				sizeof(Settings.m_default),
+				reinterpret_cast<const uint8_t*>(&Settings.m_default),
+				false
+			} ...
+		};
+		return m_kvs->ReadObjects(reads, Layout::COUNT);
+	}
+
+	/**
+		@brief Returns the current value of a setting
+	 */
+	template<const auto& Setting>
+	auto Get()
+	{
+		static_assert(Layout::template IndexOf<Setting>() < Layout::COUNT, "Setting is not in this schema");
+
+		decltype(Setting.m_default) value;
+		memcpy(&value, m_values + Layout::template OffsetOf<Setting>(), sizeof(value));
+		return value;
+	}
+
+	/**
+		@brief Changes the value of a setting, writing it to the KVS only if it differs from the current value
+
+		@return True on success (including when nothing had to be written)
+	 */
+	template<const auto& Setting>
+	bool Set(const decltype(Setting.m_default)& value)
+	{
+		static_assert(Layout::template IndexOf<Setting>() < Layout::COUNT, "Setting is not in this schema");
+
+		auto p = m_values + Layout::template OffsetOf<Setting>();
+		if(memcmp(p, &value, sizeof(value)) == 0)
+			return true;
+		if(!m_kvs->StoreObject(Setting.m_name, reinterpret_cast<const uint8_t*>(&value), sizeof(value)))
+			return false;
+		memcpy(p, &value, sizeof(value));
+		return true;
+	}
+
+protected:
+
+	///@brief Sets every setting to its default
+	void LoadDefaults()
+	{
+		(memcpy(m_values + Layout::template OffsetOf<Settings>(), &Settings.m_default, sizeof(Settings.m_default)), ...);
+	}
+
+	KVS* m_kvs;
+
+	///@brief Current value of each setting, at Layout::OffsetOf() for it
+	alignas(decltype(Settings.m_default)...) uint8_t m_values[Layout::Size()];
+};
+
+#endif
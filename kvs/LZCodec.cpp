@@ -0,0 +1,268 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* microkvs                                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2021-2024 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author	Andrew D. Zonenberg
+	@brief	Implementation of LZCodec
+ */
+#include "LZCodec.h"
+#include <string.h>
+
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_OFFSET	65535
+
+static inline uint32_t LZRead32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t LZHash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - KVS_LZ_HASH_BITS);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Compression
+
+/**
+	@brief Compresses a block of data
+
+	@param in		Input data
+	@param len		Length of the input data
+	@param sink		Destination for the compressed stream
+
+	@return True on success, false if the sink reported an error
+ */
+bool LZCodec::Compress(const uint8_t* in, uint32_t len, KVSByteSink* sink)
+{
+	uint8_t hdr[4] =
+	{
+		static_cast<uint8_t>(len & 0xff),
+		static_cast<uint8_t>((len >> 8) & 0xff),
+		static_cast<uint8_t>((len >> 16) & 0xff),
+		static_cast<uint8_t>(len >> 24)
+	};
+	if(!sink->Write(hdr, sizeof(hdr)))
+		return false;
+
+	//Table of (position + 1) for each hash value, 0 = empty
+	uint32_t table[1 << KVS_LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	uint32_t anchor = 0;
+	uint32_t i = 0;
+	while(i + LZ_MIN_MATCH <= len)
+	{
+		uint32_t seq = LZRead32(in + i);
+		uint32_t h = LZHash(seq);
+		uint32_t cand = table[h];
+		table[h] = i + 1;
+
+		//No usable match, move on
+		if( (cand == 0) || ( (i - (cand - 1)) > LZ_MAX_OFFSET) || (LZRead32(in + cand - 1) != seq) )
+		{
+			i++;
+			continue;
+		}
+
+		//Extend the match as far as it goes
+		uint32_t m = cand - 1;
+		uint32_t matchlen = LZ_MIN_MATCH;
+		while( (i + matchlen < len) && (in[m + matchlen] == in[i + matchlen]) )
+			matchlen ++;
+
+		if(!EmitSequence(sink, in + anchor, i - anchor, i - m, matchlen))
+			return false;
+
+		i += matchlen;
+		anchor = i;
+	}
+
+	//Trailing literals (also covers inputs too short to contain any match)
+	if(anchor < len)
+		return EmitSequence(sink, in + anchor, len - anchor, 0, 0);
+	return true;
+}
+
+/**
+	@brief Writes a single sequence to the output. An offset of zero means the sequence has literals only.
+ */
+bool LZCodec::EmitSequence(
+	KVSByteSink* sink,
+	const uint8_t* literals,
+	uint32_t nliterals,
+	uint32_t offset,
+	uint32_t matchlen)
+{
+	uint32_t litnibble = (nliterals >= 15) ? 15 : nliterals;
+	uint32_t matchnibble = 0;
+	if(offset != 0)
+	{
+		matchnibble = matchlen - LZ_MIN_MATCH;
+		if(matchnibble > 15)
+			matchnibble = 15;
+	}
+
+	uint8_t token = (litnibble << 4) | matchnibble;
+	if(!sink->Write(&token, 1))
+		return false;
+	if( (litnibble == 15) && !EmitLength(sink, nliterals - 15) )
+		return false;
+	if( (nliterals != 0) && !sink->Write(literals, nliterals) )
+		return false;
+
+	if(offset == 0)
+		return true;
+
+	uint8_t off[2] = { static_cast<uint8_t>(offset & 0xff), static_cast<uint8_t>(offset >> 8) };
+	if(!sink->Write(off, sizeof(off)))
+		return false;
+	if(matchnibble == 15)
+		return EmitLength(sink, matchlen - LZ_MIN_MATCH - 15);
+	return true;
+}
+
+/**
+	@brief Writes the continuation bytes of a length field
+ */
+bool LZCodec::EmitLength(KVSByteSink* sink, uint32_t len)
+{
+	uint8_t ff = 0xff;
+	while(len >= 255)
+	{
+		if(!sink->Write(&ff, 1))
+			return false;
+		len -= 255;
+	}
+
+	uint8_t last = len;
+	return sink->Write(&last, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Decompression
+
+/**
+	@brief Returns the uncompressed size of a compressed stream
+ */
+uint32_t LZCodec::GetDecompressedLength(const uint8_t* in, uint32_t inlen)
+{
+	if(inlen < 4)
+		return 0;
+	return in[0] | (in[1] << 8) | (in[2] << 16) | (in[3] << 24);
+}
+
+/**
+	@brief Decompresses a block of data
+
+	If the output buffer is smaller than the uncompressed data, decompression stops once the buffer is full.
+
+	@param in		Compressed stream
+	@param inlen	Length of the compressed stream
+	@param out		Output buffer
+	@param outlen	Size of the output buffer
+
+	@return Number of bytes written to the output buffer, or 0 if the stream is malformed
+ */
+uint32_t LZCodec::Decompress(const uint8_t* in, uint32_t inlen, uint8_t* out, uint32_t outlen)
+{
+	uint32_t rawlen = GetDecompressedLength(in, inlen);
+	if(outlen > rawlen)
+		outlen = rawlen;
+
+	const uint8_t* end = in + inlen;
+	in += 4;
+	uint32_t pos = 0;
+
+	while( (in < end) && (pos < outlen) )
+	{
+		uint8_t token = *(in++);
+
+		//Literal length
+		uint32_t nliterals = token >> 4;
+		if(nliterals == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if(in >= end)
+					return 0;
+				b = *(in++);
+				nliterals += b;
+			} while(b == 255);
+		}
+
+		//Copy literals
+		if(nliterals > static_cast<uint32_t>(end - in))
+			return 0;
+		uint32_t ncopy = nliterals;
+		if(ncopy > outlen - pos)
+			ncopy = outlen - pos;
+		memcpy(out + pos, in, ncopy);
+		pos += ncopy;
+		in += nliterals;
+
+		//End of stream after the last literals
+		if( (in >= end) || (pos >= outlen) )
+			break;
+
+		//Match offset and length
+		if(end - in < 2)
+			return 0;
+		uint32_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		uint32_t matchlen = token & 0xf;
+		if(matchlen == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if(in >= end)
+					return 0;
+				b = *(in++);
+				matchlen += b;
+			} while(b == 255);
+		}
+		matchlen += LZ_MIN_MATCH;
+
+		if( (offset == 0) || (offset > pos) )
+			return 0;
+
+		//Copy the match a byte at a time since source and destination may overlap
+		if(matchlen > outlen - pos)
+			matchlen = outlen - pos;
+		for(uint32_t i=0; i<matchlen; i++, pos++)
+			out[pos] = out[pos - offset];
+	}
+
+	return pos;
+}
@@ -0,0 +1,98 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* microkvs                                                                                                             *
+*                                                                                                                      *
+* Copyright (c) 2021-2024 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author	Andrew D. Zonenberg
+	@brief	Declaration of LZCodec
+ */
+
+#ifndef LZCodec_h
+#define LZCodec_h
+
+#include <stdint.h>
+
+//Number of bits in the match finder hash table. Each entry costs 4 bytes of stack during compression.
+#ifndef KVS_LZ_HASH_BITS
+#define KVS_LZ_HASH_BITS 8
+#endif
+
+/**
+	@brief Destination for a stream of bytes produced incrementally
+ */
+class KVSByteSink
+{
+public:
+	virtual bool Write(const uint8_t* data, uint32_t len) =0;
+};
+
+/**
+	@brief Origin of a stream of bytes consumed incrementally
+ */
+class KVSByteSource
+{
+public:
+	///@brief Reads exactly len bytes, returning false if that many aren't available
+	virtual bool Read(uint8_t* data, uint32_t len) =0;
+};
+
+/**
+	@brief Small, allocation free LZ77 codec for object content
+
+	The compressed stream starts with the uncompressed length as a little endian uint32_t, followed by a series of
+	sequences in a byte oriented format similar to an LZ4 block:
+
+	* Token byte: literal count in the high nibble, match length minus 4 in the low nibble.
+	  A nibble value of 15 means the count continues in following bytes (each 255 adds more, anything less ends it)
+	* Literal bytes
+	* 16-bit little endian match offset (distance back from the current output position) followed by any match
+	  length continuation bytes. The final sequence ends after its literals and has no match.
+
+	Compression uses a fixed size hash table on the stack and produces output through a KVSByteSink, so the caller
+	never needs a buffer for the compressed data. Decompression reads the compressed stream directly (e.g. from memory
+	mapped flash) and writes to the caller's buffer, with back references resolved against that buffer.
+ */
+class LZCodec
+{
+public:
+	static bool Compress(const uint8_t* in, uint32_t len, KVSByteSink* sink);
+	static uint32_t Decompress(const uint8_t* in, uint32_t inlen, uint8_t* out, uint32_t outlen);
+	static uint32_t GetDecompressedLength(const uint8_t* in, uint32_t inlen);
+
+protected:
+	static bool EmitSequence(
+		KVSByteSink* sink,
+		const uint8_t* literals,
+		uint32_t nliterals,
+		uint32_t offset,
+		uint32_t matchlen);
+	static bool EmitLength(KVSByteSink* sink, uint32_t len);
+};
+
+#endif
@@ -69,16 +69,69 @@
 class LogEntry
 {
 public:
+
+	///@brief Flags describing how the object content is stored
+	enum Flags
+	{
+		///@brief Content is LZ compressed (see LZCodec), m_len is the compressed size
+		FLAG_COMPRESSED	= 0x00000001,
+
+		///@brief Content (up to 4 bytes) is stored in m_start instead of the data area. Covered by the header CRC.
+		FLAG_INLINE		= 0x00000002,
+
+		/**
+			@brief Not an object: deletes every earlier object whose name begins with the first m_start bytes of
+			m_key. m_len is zero. Covered by the header CRC.
+		 */
+		FLAG_PREFIX_DELETE	= 0x00000004,
+
+		/**
+			@brief Content is a counter: a uint32_t base value (covered by m_crc), padded to a write block, followed by
+			space for KVS_COUNTER_INCREMENTS increments which are each recorded by programming the next blank bit (or
+			write block, if MICROKVS_WRITE_BLOCK_SIZE is set). m_len includes the increment space.
+		 */
+		FLAG_COUNTER		= 0x00000008,
+
+		/**
+			@brief Content can be updated in place by programming more bits (see KVS::StoreRewritableObject). The
+			content is followed by KVS_REWRITE_SLOTS uint32_t CRC slots, used in order, which hold the CRC after each
+			in-place update. m_crc is the CRC before the first update. m_len includes the slots.
+		 */
+		FLAG_REWRITABLE		= 0x00000010,
+
+		///@brief Object can be appended to with KVS::AppendObject(). Its content continues in FLAG_SEGMENT entries.
+		FLAG_APPENDABLE		= 0x00000020,
+
+		/**
+			@brief Not an object: content appended to the most recent entry with the same key, which must have
+			FLAG_APPENDABLE set. Has its own data and CRC. Ignored if any other entry with the same key comes between.
+		 */
+		FLAG_SEGMENT		= 0x00000040,
+
+		/**
+			@brief Content is a list of changes to the previous entry with the same key, which must be a valid plain
+			or delta revision. See KVS::StoreDeltaObject().
+		 */
+		FLAG_DELTA			= 0x00000080,
+
+		/**
+			@brief Content is followed by a CRC for each KVS_CHUNK_SIZE byte chunk of it, then its length as a
+			uint32_t. m_crc covers the chunk CRCs and length, not the content. See KVS::StoreChunkedObject().
+		 */
+		FLAG_CHUNKED		= 0x00000100
+	};
+
 	char		m_key[KVS_NAMELEN];
 	uint32_t	m_start;
 	uint32_t	m_len;
-	uint32_t	m_crc;			//crc32 of packet content
-	uint32_t	m_headerCRC;	//crc32 of {key, start, len}
+	uint32_t	m_flags;		//bitmask of Flags
+	uint32_t	m_crc;			//crc32 of packet content as stored
+	uint32_t	m_headerCRC;	//crc32 of {key, start, len, flags}
 
 	//pad to write block size
 	#ifdef MICROKVS_WRITE_BLOCK_SIZE
-		#if MICROKVS_WRITE_BLOCK_SIZE >= 16
-			uint8_t		m_padding[MICROKVS_WRITE_BLOCK_SIZE - (16 % MICROKVS_WRITE_BLOCK_SIZE)];
+		#if (20 % MICROKVS_WRITE_BLOCK_SIZE) != 0
+			uint8_t		m_padding[MICROKVS_WRITE_BLOCK_SIZE - (20 % MICROKVS_WRITE_BLOCK_SIZE)];
 		#endif
 	#endif
 };
@@ -28,13 +28,75 @@
 ***********************************************************************************************************************/
 
 #include <kvs/KVS.h>
+#include <kvs/KVSSchema.h>
 #include <driver/TestStorageBank.h>
 #include <stdio.h>
 
+constexpr KVSSetting<uint64_t> g_bv("bv", 9);
+constexpr KVSSetting<uint16_t> g_port("port", 80);
+
 void PrintState(KVS& kvs);
 
 bool WriteAndVerify(KVS& kvs, const char* name, uint8_t* data, uint32_t len);
 bool Verify(KVS& kvs, const char* name, uint8_t* data, uint32_t len);
+bool VerifyRead(KVS& kvs, const char* name, const uint8_t* data, uint32_t len);
+bool BuildLegacyBank(TestStorageBank& bank);
+
+/**
+	@brief RAM buffer which a snapshot can be exported to and imported from
+ */
+class SnapshotBuffer : public KVSByteSink, public KVSByteSource
+{
+public:
+	SnapshotBuffer()
+	: m_writePtr(0)
+	, m_readPtr(0)
+	{}
+
+	virtual bool Write(const uint8_t* data, uint32_t len)
+	{
+		if(m_writePtr + len > sizeof(m_data))
+			return false;
+		memcpy(m_data + m_writePtr, data, len);
+		m_writePtr += len;
+		return true;
+	}
+
+	virtual bool Read(uint8_t* data, uint32_t len)
+	{
+		if(m_readPtr + len > m_writePtr)
+			return false;
+		memcpy(data, m_data + m_readPtr, len);
+		m_readPtr += len;
+		return true;
+	}
+
+	uint8_t m_data[8192];
+	uint32_t m_writePtr;
+	uint32_t m_readPtr;
+};
+
+/**
+	@brief Snapshot buffer which supplies endless filler once its content runs out, like a corrupted or hostile stream
+ */
+class EndlessSnapshot : public SnapshotBuffer
+{
+public:
+	EndlessSnapshot()
+	: m_fillerRead(0)
+	{}
+
+	virtual bool Read(uint8_t* data, uint32_t len)
+	{
+		if(m_readPtr + len <= m_writePtr)
+			return SnapshotBuffer::Read(data, len);
+		memset(data, 0xa5, len);
+		m_fillerRead += len;
+		return true;
+	}
+
+	uint64_t m_fillerRead;
+};
 
 int main(int argc, char* argv[])
 {
@@ -106,9 +168,849 @@ int main(int argc, char* argv[])
 	if(!Verify(kvs, "monorail", (uint8_t*)data5, strlen(data5)))
 		return 1;
 
+	//Compressed object: should take less space than the raw content, and survive compaction
+	char text[512];
+	for(uint32_t i=0; i<sizeof(text); i++)
+		text[i] = "calibration table "[i % 18];
+	uint32_t freeBefore = kvs.GetFreeDataSpace();
+	if(!kvs.StoreCompressedObject("cal", (uint8_t*)text, sizeof(text)))
+	{
+		printf("Failed to store compressed object\n");
+		return 1;
+	}
+	if(freeBefore - kvs.GetFreeDataSpace() >= sizeof(text))
+	{
+		printf("Compressed object didn't get any smaller\n");
+		return 1;
+	}
+	if(!VerifyRead(kvs, "cal", (uint8_t*)text, sizeof(text)))
+		return 1;
+	kvs.Compact();
+	if(!VerifyRead(kvs, "cal", (uint8_t*)text, sizeof(text)))
+		return 1;
+
+	printf("COMPRESSED\n");
+	PrintState(kvs);
+
+	//Identical content under different names should only be stored once, including after compaction
+	const char* defaults = "default port configuration";
+	if(!WriteAndVerify(kvs, "eth0.cfg", (uint8_t*)defaults, strlen(defaults)))
+		return 1;
+	freeBefore = kvs.GetFreeDataSpace();
+	if(!WriteAndVerify(kvs, "eth1.cfg", (uint8_t*)defaults, strlen(defaults)))
+		return 1;
+	#if KVS_DEDUP_TABLE_SIZE > 0
+	if(kvs.GetFreeDataSpace() != freeBefore)
+	{
+		printf("Duplicate content was not shared\n");
+		return 1;
+	}
+	#endif
+	kvs.Compact();
+	#if KVS_DEDUP_TABLE_SIZE > 0
+	if(kvs.FindObject("eth0.cfg")->m_start != kvs.FindObject("eth1.cfg")->m_start)
+	{
+		printf("Compaction did not preserve shared content\n");
+		return 1;
+	}
+	#endif
+	if(!Verify(kvs, "eth1.cfg", (uint8_t*)defaults, strlen(defaults)))
+		return 1;
+
+	printf("DEDUPLICATED\n");
+	PrintState(kvs);
+
+	//Asynchronous compaction on slow flash: should take several polls, and leave everything intact
+	uint32_t completions = 0;
+	auto callback = [](StorageBank*, bool, void* param) { (*reinterpret_cast<uint32_t*>(param)) ++; };
+	left.SetAsyncDelay(20, 2);
+	right.SetAsyncDelay(20, 2);
+	left.SetCompletionCallback(callback, &completions);
+	right.SetCompletionCallback(callback, &completions);
+	if(!kvs.StartCompact())
+	{
+		printf("Failed to start compaction\n");
+		return 1;
+	}
+	uint32_t polls = 0;
+	KVS::AsyncStatus status;
+	while( (status = kvs.PollCompact()) == KVS::ASYNC_BUSY)
+		polls ++;
+	if( (status != KVS::ASYNC_DONE) || (polls < 20) || (completions == 0) )
+	{
+		printf("Asynchronous compaction failed\n");
+		return 1;
+	}
+	if(!Verify(kvs, "shibe", (uint8_t*)data4, strlen(data4)))
+		return 1;
+	if(!VerifyRead(kvs, "cal", (uint8_t*)text, sizeof(text)))
+		return 1;
+	left.SetAsyncDelay(0, 0);
+	right.SetAsyncDelay(0, 0);
+
+	printf("ASYNC COMPACTED (%u polls, %u operations)\n", polls, completions);
+	PrintState(kvs);
+
+	//Pre-erase the inactive bank, make sure that survives a "reboot", and that the next compaction skips the erase
+	if(!kvs.PrepareInactiveBank())
+	{
+		printf("Failed to prepare inactive bank\n");
+		return 1;
+	}
+	KVS rebooted(&left, &right, 128);
+	if(!rebooted.IsInactiveBankPrepared())
+	{
+		printf("Prepared bank not detected after reboot\n");
+		return 1;
+	}
+	left.SetAsyncDelay(1000, 0);
+	right.SetAsyncDelay(1000, 0);
+	rebooted.StartCompact();
+	polls = 0;
+	while( (status = rebooted.PollCompact()) == KVS::ASYNC_BUSY)
+		polls ++;
+	left.SetAsyncDelay(0, 0);
+	right.SetAsyncDelay(0, 0);
+	if( (status != KVS::ASYNC_DONE) || (polls >= 1000) || rebooted.IsInactiveBankPrepared() )
+	{
+		printf("Compaction didn't use the prepared bank\n");
+		return 1;
+	}
+	if(!VerifyRead(rebooted, "cal", (uint8_t*)text, sizeof(text)))
+		return 1;
+	if(!Verify(rebooted, "eth0.cfg", (uint8_t*)defaults, strlen(defaults)))
+		return 1;
+
+	printf("COMPACTED INTO PREPARED BANK\n");
+	PrintState(rebooted);
+
+	//Small scalars are stored inline in the log entry and use no data space.
+	//An all-ones value must not be mistaken for the end of the log.
+	freeBefore = rebooted.GetFreeDataSpace();
+	if(!rebooted.StoreObjectIfNecessary<uint16_t>("port", 8080, 80))
+		return 1;
+	uint32_t allones = 0xffffffff;
+	if(!WriteAndVerify(rebooted, "mask", (uint8_t*)&allones, sizeof(allones)))
+		return 1;
+	if(!rebooted.StoreObjectIfNecessary<bool>("enabled", true, false))
+		return 1;
+	#if KVS_INLINE_MAX >= 4
+	if(rebooted.GetFreeDataSpace() != freeBefore)
+	{
+		printf("Inline objects used data space\n");
+		return 1;
+	}
+	#endif
+	rebooted.Compact();
+	KVS rebooted2(&left, &right, 128);
+	if( (rebooted2.ReadObject<uint16_t>("port", 80) != 8080) ||
+		!rebooted2.ReadObject<bool>("enabled", false) ||
+		!Verify(rebooted2, "mask", (uint8_t*)&allones, sizeof(allones)) )
+	{
+		printf("Inline objects read back wrong\n");
+		return 1;
+	}
+
+	printf("INLINE\n");
+	PrintState(rebooted2);
+
+	//Page through one namespace a single key at a time, then list a range
+	KVSListEntry page[4];
+	KVSEnumCursor cursor;
+	const char* expected[] = {"eth0.cfg", "eth1.cfg"};
+	for(auto name : expected)
+	{
+		if( (rebooted2.EnumObjectsPrefix("eth", page, 1, &cursor) != 1) || strcmp(page[0].key, name) )
+		{
+			printf("Prefix enumeration returned wrong key\n");
+			return 1;
+		}
+	}
+	if( (rebooted2.EnumObjectsPrefix("eth", page, 1, &cursor) != 0) || !cursor.IsDone() )
+	{
+		printf("Prefix enumeration didn't stop\n");
+		return 1;
+	}
+	if( (rebooted2.EnumObjectsRange("e", "eth0.cfg", page, 4) != 2) ||
+		strcmp(page[0].key, "enabled") || strcmp(page[1].key, "eth0.cfg") )
+	{
+		printf("Range enumeration returned wrong keys\n");
+		return 1;
+	}
+
+	printf("FILTERED ENUMERATION\n");
+
+	//Delete one object, then a whole namespace with a single log entry
+	const char* names[] = {"user.a", "user.b", "user.c"};
+	for(auto name : names)
+	{
+		if(!WriteAndVerify(rebooted2, name, (uint8_t*)name, strlen(name)))
+			return 1;
+	}
+	auto logBefore = rebooted2.GetFreeLogEntries();
+	if(!rebooted2.DeleteObject("port") || !rebooted2.DeletePrefix("user.") ||
+		(rebooted2.GetFreeLogEntries() != logBefore - 2) )
+	{
+		printf("Delete failed\n");
+		return 1;
+	}
+	if(rebooted2.FindObject("port") || rebooted2.FindObject("user.a") || rebooted2.FindObject("user.c"))
+	{
+		printf("Deleted object still present\n");
+		return 1;
+	}
+	if(!WriteAndVerify(rebooted2, "user.c", (uint8_t*)data4, strlen(data4)))
+		return 1;
+
+	//Enough other objects to push the deleted ones out of the compaction cache, so they can't come back
+	for(int i=0; i<KVS_COMPACT_CACHE_SIZE + 4; i++)
+	{
+		if(!rebooted2.StoreObject((uint8_t*)&i, sizeof(i), "k%d", i))
+			return 1;
+	}
+	rebooted2.Compact();
+	KVS rebooted3(&left, &right, 128);
+	if(rebooted3.FindObject("port") || rebooted3.FindObject("user.a") || rebooted3.FindObject("user.b") ||
+		!Verify(rebooted3, "user.c", (uint8_t*)data4, strlen(data4)) ||
+		(rebooted3.EnumObjectsPrefix("user.", page, 4) != 1) )
+	{
+		printf("Deleted objects came back after compaction\n");
+		return 1;
+	}
+
+	printf("DELETED\n");
+	PrintState(rebooted3);
+
+	//Handles pick up new versions, deletions, and compactions
+	KVSHandle speed("speed");
+	if(rebooted3.ReadObject<uint16_t>(speed, 10) != 10)
+		return 1;
+	uint16_t speeds[] = {100, 1000};
+	for(auto value : speeds)
+	{
+		if(!rebooted3.StoreObject(speed, (uint8_t*)&value, sizeof(value)) ||
+			!rebooted3.StoreObject("other", (uint8_t*)&value, sizeof(value)) ||
+			(rebooted3.ReadObject<uint16_t>(speed, 10) != value) )
+		{
+			printf("Handle read back wrong value\n");
+			return 1;
+		}
+	}
+	rebooted3.Compact();
+	if(rebooted3.ReadObject<uint16_t>(speed, 10) != 1000)
+	{
+		printf("Handle not updated after compaction\n");
+		return 1;
+	}
+	rebooted3.DeleteObject("speed");
+	if(rebooted3.FindObject(speed))
+	{
+		printf("Handle not updated after delete\n");
+		return 1;
+	}
+
+	printf("HANDLES\n");
+
+	//Watches fire on stores and on deletes which overlap them, and not otherwise
+	KVSWatch watches[2];
+	uint32_t speedChanges = 0;
+	uint32_t userChanges = 0;
+	auto counter = [](KVS*, LogEntry*, void* param) { (*reinterpret_cast<uint32_t*>(param)) ++; };
+	rebooted3.SetWatchTable(watches, 2);
+	if(!rebooted3.Watch("speed", counter, &speedChanges) ||
+		!rebooted3.WatchPrefix("user.", counter, &userChanges) ||
+		rebooted3.Watch("other", counter, &speedChanges) )
+	{
+		printf("Watch table capacity wrong\n");
+		return 1;
+	}
+	rebooted3.StoreObject("speed", (uint8_t*)&speeds[0], sizeof(speeds[0]));
+	rebooted3.StoreObject("user.x", (uint8_t*)&speeds[0], sizeof(speeds[0]));
+	rebooted3.StoreObject("other", (uint8_t*)&speeds[0], sizeof(speeds[0]));
+	rebooted3.DeletePrefix("user.x");
+	rebooted3.DeletePrefix("u");
+	rebooted3.Unwatch(counter, &userChanges);
+	rebooted3.StoreObject("user.y", (uint8_t*)&speeds[0], sizeof(speeds[0]));
+	if( (speedChanges != 1) || (userChanges != 3) )
+	{
+		printf("Watch callbacks fired wrong (%u, %u)\n", speedChanges, userChanges);
+		return 1;
+	}
+
+	printf("WATCHES\n");
+
+	//Changes since a cursor are reported in order, until a compaction invalidates the cursor
+	auto sync = rebooted3.GetChangeCursor();
+	LogEntry* change = nullptr;
+	if(rebooted3.GetNextChange(sync, change) != KVS::CHANGE_NONE)
+		return 1;
+	rebooted3.StoreObject("speed", (uint8_t*)&speeds[1], sizeof(speeds[1]));
+	rebooted3.DeletePrefix("user.");
+	const char* changes[] = {"speed", "user."};
+	for(auto name : changes)
+	{
+		if( (rebooted3.GetNextChange(sync, change) != KVS::CHANGE_FOUND) || strcmp(change->m_key, name) )
+		{
+			printf("Wrong change reported\n");
+			return 1;
+		}
+	}
+	if(!(change->m_flags & LogEntry::FLAG_PREFIX_DELETE) || (rebooted3.GetNextChange(sync, change) != KVS::CHANGE_NONE))
+	{
+		printf("Wrong change reported\n");
+		return 1;
+	}
+	rebooted3.Compact();
+	if(rebooted3.GetNextChange(sync, change) != KVS::CHANGE_CURSOR_INVALID)
+	{
+		printf("Cursor not invalidated by compaction\n");
+		return 1;
+	}
+
+	printf("CHANGES\n");
+
+	//Clone the store to another device via a snapshot, replacing what was there
+	SnapshotBuffer snapshot;
+	if(!rebooted3.ExportSnapshot(&snapshot))
+	{
+		printf("Export failed\n");
+		return 1;
+	}
+	TestStorageBank cloneLeft;
+	TestStorageBank cloneRight;
+	KVS clone(&cloneLeft, &cloneRight, 128);
+	clone.StoreObject("junk", (uint8_t*)data, strlen(data));
+	snapshot.m_data[snapshot.m_writePtr - 20] ^= 1;
+	if(clone.ImportSnapshot(&snapshot) || !clone.FindObject("junk"))
+	{
+		printf("Corrupted snapshot was imported\n");
+		return 1;
+	}
+	snapshot.m_data[snapshot.m_writePtr - 20] ^= 1;
+	snapshot.m_readPtr = 0;
+
+	//A frame too big for the bank is rejected before any content is read, even if its length wraps around
+	struct
+	{
+		char		m_key[KVS_NAMELEN];
+		uint32_t	m_flags;
+		uint32_t	m_len;
+		uint32_t	m_crc;
+		uint32_t	m_headerCRC;
+	} hugeFrame;
+	memset(&hugeFrame, 0, sizeof(hugeFrame));
+	memcpy(hugeFrame.m_key, "huge", 4);
+	hugeFrame.m_len = 0xfffff000;
+	hugeFrame.m_headerCRC = cloneLeft.CRC((uint8_t*)&hugeFrame, sizeof(hugeFrame) - sizeof(uint32_t));
+	EndlessSnapshot oversized;
+	oversized.Write(snapshot.m_data, 2*sizeof(uint32_t));
+	oversized.Write((uint8_t*)&hugeFrame, sizeof(hugeFrame));
+	if(clone.ImportSnapshot(&oversized) || (oversized.m_fillerRead != 0) || !clone.FindObject("junk"))
+	{
+		printf("Oversized snapshot frame was imported\n");
+		return 1;
+	}
+
+	if(!clone.ImportSnapshot(&snapshot))
+	{
+		printf("Import failed\n");
+		return 1;
+	}
+	KVS clone2(&cloneLeft, &cloneRight, 128);
+	if(clone2.FindObject("junk") || clone2.FindObject("user.y") ||
+		(clone2.ReadObject<uint16_t>("speed", 0) != 1000) ||
+		!VerifyRead(clone2, "cal", (uint8_t*)text, sizeof(text)) ||
+		!Verify(clone2, "shibe", (uint8_t*)data4, strlen(data4)) ||
+		(clone2.GetFreeLogEntries() != rebooted3.GetFreeLogEntries()) )
+	{
+		printf("Imported snapshot is wrong\n");
+		return 1;
+	}
+
+	printf("CLONED (%u byte snapshot)\n", snapshot.m_writePtr);
+	PrintState(clone2);
+
+	//Counters increment in place, only needing a new log entry when their increment space runs out
+	logBefore = clone2.GetFreeLogEntries();
+	const uint32_t nboots = KVS_COUNTER_INCREMENTS + 5;
+	for(uint32_t i=0; i<nboots; i++)
+	{
+		if(!clone2.IncrementCounter("boots"))
+			return 1;
+	}
+	if( (clone2.ReadObject<uint32_t>("boots", 0) != nboots) || (clone2.GetFreeLogEntries() != logBefore - 2) )
+	{
+		printf("Counter is wrong\n");
+		return 1;
+	}
+	uint32_t seq = 41;
+	clone2.StoreObject("seq", (uint8_t*)&seq, sizeof(seq));
+	clone2.IncrementCounter("seq");
+	clone2.Compact();
+	clone2.IncrementCounter("boots");
+	KVS clone3(&cloneLeft, &cloneRight, 128);
+	if( (clone3.ReadObject<uint32_t>("boots", 0) != nboots + 1) || (clone3.ReadObject<uint32_t>("seq", 0) != 42) )
+	{
+		printf("Counter is wrong after compaction\n");
+		return 1;
+	}
+
+	printf("COUNTERS\n");
+	PrintState(clone3);
+
+	//Rewritable objects are updated in place as long as bits are only programmed
+	uint8_t prov[8];
+	memset(prov, 0xff, sizeof(prov));
+	//(the first update needs a new revision, so there's an older one to fall back to if an update is interrupted)
+	logBefore = clone3.GetFreeLogEntries();
+	if(!clone3.StoreRewritableObject("prov", prov, sizeof(prov)))
+		return 1;
+	prov[7] = 0xfe;
+	if(!clone3.StoreRewritableObject("prov", prov, sizeof(prov)) || (clone3.GetFreeLogEntries() != logBefore - 2) )
+	{
+		printf("Object without an older revision was updated in place\n");
+		return 1;
+	}
+	logBefore = clone3.GetFreeLogEntries();
+	for(int i=0; i<KVS_REWRITE_SLOTS; i++)
+	{
+		prov[i % sizeof(prov)] &= ~(1 << (i / sizeof(prov)));
+		if(!clone3.StoreRewritableObject("prov", prov, sizeof(prov)) || !VerifyRead(clone3, "prov", prov, sizeof(prov)))
+		{
+			printf("In-place update failed\n");
+			return 1;
+		}
+	}
+	#if !defined(MICROKVS_WRITE_BLOCK_SIZE) && !defined(MICROKVS_CONCURRENT_READERS)
+	if(clone3.GetFreeLogEntries() != logBefore)
+	{
+		printf("In-place update used a log entry\n");
+		return 1;
+	}
+	#endif
+
+	//Setting a bit back needs a new revision, as does running out of CRC slots
+	prov[0] = 0xff;
+	clone3.StoreRewritableObject("prov", prov, sizeof(prov));
+	clone3.Compact();
+	KVS clone4(&cloneLeft, &cloneRight, 128);
+	if(!VerifyRead(clone4, "prov", prov, sizeof(prov)))
+		return 1;
+
+	printf("REWRITABLE\n");
+	PrintState(clone4);
+
+	//Appending writes only the new record, and compaction merges the segments
+	uint8_t journal[200];
+	for(uint32_t i=0; i<sizeof(journal); i++)
+		journal[i] = i * 7;
+	clone4.StoreObject("journal", journal, 10);
+	for(uint32_t i=10; i<sizeof(journal); i += 10)
+	{
+		if(!clone4.AppendObject("journal", journal + i, 10))
+		{
+			printf("Append failed\n");
+			return 1;
+		}
+	}
+	if(!VerifyRead(clone4, "journal", journal, sizeof(journal)))
+		return 1;
+	uint32_t nsegs = 0;
+	for(auto seg = clone4.FindObject("journal"); seg; seg = clone4.GetNextSegment(seg))
+		nsegs ++;
+	if(nsegs != sizeof(journal) / 10)
+	{
+		printf("Wrong number of segments\n");
+		return 1;
+	}
+	clone4.Compact();
+	KVS clone5(&cloneLeft, &cloneRight, 128);
+	auto merged = clone5.FindObject("journal");
+	if(!merged || clone5.GetNextSegment(merged) || !VerifyRead(clone5, "journal", journal, sizeof(journal)))
+	{
+		printf("Segments weren't merged\n");
+		return 1;
+	}
+
+	//A new revision replaces the object and its segments
+	clone5.StoreObject("journal", journal, 20);
+	if(!VerifyRead(clone5, "journal", journal, 20))
+		return 1;
+
+	printf("APPENDED\n");
+	PrintState(clone5);
+
+	//Small changes to a large object only store the changed ranges, up to the chain length limit
+	uint8_t cal[512];
+	for(uint32_t i=0; i<sizeof(cal); i++)
+		cal[i] = i;
+	clone5.StoreDeltaObject("cal", cal, sizeof(cal));
+	for(int i=0; i<KVS_DELTA_CHAIN_MAX + 2; i++)
+	{
+		uint32_t spaceBefore = clone5.GetFreeDataSpace();
+		cal[i * 50] ++;
+		cal[300 + i] ^= 0x55;
+		if(!clone5.StoreDeltaObject("cal", cal, sizeof(cal)) || !VerifyRead(clone5, "cal", cal, sizeof(cal)))
+		{
+			printf("Delta update failed\n");
+			return 1;
+		}
+
+		//Every KVS_DELTA_CHAIN_MAX+1'th revision is a full copy
+		bool full = (i == KVS_DELTA_CHAIN_MAX);
+		if( full != (spaceBefore - clone5.GetFreeDataSpace() >= sizeof(cal)) )
+		{
+			printf("Delta revision has the wrong size\n");
+			return 1;
+		}
+	}
+	clone5.Compact();
+	KVS clone6(&cloneLeft, &cloneRight, 128);
+	auto folded = clone6.FindObject("cal");
+	if(!folded || !clone6.MapObject(folded) || !VerifyRead(clone6, "cal", cal, sizeof(cal)))
+	{
+		printf("Deltas weren't folded\n");
+		return 1;
+	}
+
+	printf("DELTAS\n");
+	PrintState(clone6);
+
+	//Patching copies the unchanged content flash to flash (rebuilding it if stored as a delta), and may extend the object
+	cal[5] ++;
+	clone6.StoreDeltaObject("cal", cal, sizeof(cal));
+	const uint8_t fix[6] = {1, 2, 3, 4, 5, 6};
+	memcpy(cal + 100, fix, sizeof(fix));
+	if(!clone6.PatchObject("cal", 100, fix, sizeof(fix)) || !VerifyRead(clone6, "cal", cal, sizeof(cal)))
+	{
+		printf("Patch failed\n");
+		return 1;
+	}
+	clone6.StoreObject("short", fix, 3);
+	const uint8_t shortPatched[5] = {1, 2, 1, 2, 3};
+	if(!clone6.PatchObject("short", 2, fix, 3) || !VerifyRead(clone6, "short", shortPatched, sizeof(shortPatched)) ||
+		clone6.PatchObject("short", 6, fix, 1) || clone6.PatchObject("nonexistent", 0, fix, 1) )
+	{
+		printf("Patch of small object failed\n");
+		return 1;
+	}
+
+	printf("PATCHED\n");
+	PrintState(clone6);
+
+	//Chunked objects only check the chunks a read touches
+	uint8_t table[1000];
+	for(uint32_t i=0; i<sizeof(table); i++)
+		table[i] = i ^ 0xa5;
+	if(!clone6.StoreChunkedObject("table", table, sizeof(table)) || !VerifyRead(clone6, "table", table, sizeof(table)))
+		return 1;
+	//(write a new revision, so none of its chunks are known to be good yet)
+	clone6.StoreChunkedObject("table", table, sizeof(table));
+	auto tlog = clone6.FindObject("table");
+	uint8_t slice[16];
+	if(!clone6.ReadObjectRange(tlog, 250, slice, sizeof(slice)) || (memcmp(slice, table + 250, sizeof(slice)) != 0) )
+	{
+		printf("Ranged read failed\n");
+		return 1;
+	}
+	clone6.MapObject(tlog)[600] ^= 1;
+	if(!clone6.ReadObjectRange(tlog, 300, slice, sizeof(slice)) || clone6.ReadObjectRange(tlog, 500, slice, 16) ||
+		(clone6.FindObject("table") != tlog) || clone6.ReadObjectRange(tlog, 990, slice, sizeof(slice)) )
+	{
+		printf("Corrupted chunk or out of bounds read not detected\n");
+		return 1;
+	}
+	clone6.MapObject(tlog)[600] ^= 1;
+
+	printf("CHUNKED\n");
+	PrintState(clone6);
+
+	//Batch reads find every object in one pass, falling back to older revisions or defaults as needed
+	uint64_t bv = 1;
+	clone6.StoreObject("bv", (uint8_t*)&bv, sizeof(bv));
+	bv = 2;
+	clone6.StoreObject("bv", (uint8_t*)&bv, sizeof(bv));
+	auto bvdata = clone6.MapObject(clone6.FindObject("bv"));
+	bvdata[0] ^= 0xff;
+	uint8_t bcal[8];
+	uint8_t bshort[5];
+	uint64_t bmissing = 0;
+	const uint64_t bdefault = 42;
+	KVSBatchRead reads[] =
+	{
+		{"cal",		bcal,					sizeof(bcal),		nullptr,					false},
+		{"bv",		(uint8_t*)&bv,			sizeof(bv),			nullptr,					false},
+		{"nothere",	(uint8_t*)&bmissing,	sizeof(bmissing),	(const uint8_t*)&bdefault,	false},
+		{"short",	bshort,					sizeof(bshort),		nullptr,					false}
+	};
+	if( (clone6.ReadObjects(reads, 4) != 3) || (memcmp(bcal, cal, sizeof(bcal)) != 0) || (bv != 1) ||
+		(bmissing != 42) || reads[2].m_found || (memcmp(bshort, shortPatched, sizeof(bshort)) != 0) )
+	{
+		printf("Batch read failed\n");
+		return 1;
+	}
+	bvdata[0] ^= 0xff;
+	clone6.DeletePrefix("sh");
+	if( (clone6.ReadObjects(reads, 4) != 2) || reads[3].m_found)
+	{
+		printf("Batch read found a deleted object\n");
+		return 1;
+	}
+
+	printf("BATCH\n");
+	PrintState(clone6);
+
+	//Schema settings are loaded in one go and then read from RAM, and only written when changed
+	KVSSchema<g_port, g_bv> config(&clone6);
+	if( (config.Load() != 1) || (config.Get<g_bv>() != 2) || (config.Get<g_port>() != 80) )
+	{
+		printf("Schema load failed\n");
+		return 1;
+	}
+	logBefore = clone6.GetFreeLogEntries();
+	if(!config.Set<g_port>(80) || (clone6.GetFreeLogEntries() != logBefore) ||
+		!config.Set<g_port>(8080) || (config.Get<g_port>() != 8080) || (clone6.ReadObject<uint16_t>("port", 0) != 8080) )
+	{
+		printf("Schema update failed\n");
+		return 1;
+	}
+
+	printf("SCHEMA\n");
+	PrintState(clone6);
+
+	//Objects with compiled-in defaults read as the default until written, without searching the log
+	static const uint32_t defaultLimit = 7;
+	static const uint16_t defaultPort = 80;
+	static const KVSDefault defaultTable[] =
+	{
+		{"limit",	&defaultLimit,	sizeof(defaultLimit)},
+		{"port",	&defaultPort,	sizeof(defaultPort)}
+	};
+	uint32_t overridden[1];
+	const KVSDefault unsorted[] = { defaultTable[1], defaultTable[0] };
+	if(clone6.SetDefaults(unsorted, 2, overridden) || !clone6.SetDefaults(defaultTable, 2, overridden))
+	{
+		printf("Defaults table not checked\n");
+		return 1;
+	}
+	logBefore = clone6.GetFreeLogEntries();
+	if( clone6.FindObject("limit") || (clone6.ReadObject<uint32_t>("limit", 0) != 7) ||
+		(clone6.ReadObject<uint16_t>("port", 0) != 8080) || !clone6.StoreObjectIfNecessary<uint32_t>("limit", 7, 0) ||
+		(clone6.GetFreeLogEntries() != logBefore) )
+	{
+		printf("Default not used\n");
+		return 1;
+	}
+	uint32_t limit = 0;
+	if( !clone6.StoreObjectIfNecessary<uint32_t>("limit", 9, 0) || (clone6.ReadObject<uint32_t>("limit", 0) != 9) ||
+		!clone6.DeleteObject("limit") || !clone6.ReadObject("limit", (uint8_t*)&limit, sizeof(limit)) || (limit != 7) )
+	{
+		printf("Overridden default not handled\n");
+		return 1;
+	}
+	KVSHandle limitHandle("limit");
+	limit = 0;
+	if( (clone6.ReadObject<uint32_t>(limitHandle, 0) != 7) ||
+		!clone6.ReadObject(limitHandle, (uint8_t*)&limit, sizeof(limit)) || (limit != 7) )
+	{
+		printf("Default not read through handle\n");
+		return 1;
+	}
+
+	printf("DEFAULTS\n");
+	PrintState(clone6);
+
+	//Deferred writes are coalesced in RAM until they expire, and are written as a group
+	//(the write cache is disabled with concurrent readers)
+	KVSCachedWrite writeCache[2];
+	#ifdef MICROKVS_CONCURRENT_READERS
+	if(clone6.SetWriteCache(writeCache, 2, 100, 8))
+	{
+		printf("Write cache enabled with concurrent readers\n");
+		return 1;
+	}
+	#else
+	if(!clone6.SetWriteCache(writeCache, 2, 100, 8))
+	{
+		printf("Write cache not enabled\n");
+		return 1;
+	}
+	logBefore = clone6.GetFreeLogEntries();
+	for(uint16_t i=0; i<50; i++)
+		clone6.StoreObjectDeferred("slider", (uint8_t*)&i, sizeof(i), i);
+	uint16_t gain = 5;
+	clone6.StoreObjectDeferred("gain", (uint8_t*)&gain, sizeof(gain), 50);
+	if( (clone6.GetFreeLogEntries() != logBefore) || (clone6.ReadObject<uint16_t>("slider", 0) != 49) ||
+		(clone6.GetDirtyBytes() != 4) || clone6.FindObject("slider") || !clone6.FlushExpired(99) ||
+		(clone6.GetDirtyBytes() != 4) )
+	{
+		printf("Deferred writes not coalesced\n");
+		return 1;
+	}
+	if( !clone6.FlushExpired(100) || (clone6.GetDirtyBytes() != 0) || (clone6.GetFreeLogEntries() != logBefore - 2) ||
+		(clone6.ReadObject<uint16_t>("slider", 0) != 49) || !clone6.FindObject("gain") )
+	{
+		printf("Deferred writes not flushed\n");
+		return 1;
+	}
+
+	//A direct write supersedes a pending deferred one
+	clone6.StoreObjectDeferred("gain", (uint8_t*)&gain, sizeof(gain), 200);
+	gain = 6;
+	clone6.StoreObject("gain", (uint8_t*)&gain, sizeof(gain));
+	if( (clone6.GetDirtyBytes() != 0) || !clone6.Flush() || (clone6.ReadObject<uint16_t>("gain", 0) != 6) )
+	{
+		printf("Deferred write not superseded\n");
+		return 1;
+	}
+
+	//Handle reads see pending content, and deleting an object discards it
+	KVSHandle gainHandle("gain");
+	gain = 7;
+	clone6.StoreObjectDeferred("gain", (uint8_t*)&gain, sizeof(gain), 300);
+	if(clone6.ReadObject<uint16_t>(gainHandle, 0) != 7)
+	{
+		printf("Deferred write not read through handle\n");
+		return 1;
+	}
+	clone6.StoreObjectDeferred("temp", (uint8_t*)&gain, sizeof(gain), 300);
+	if( !clone6.DeleteObject("gain") || !clone6.DeleteObject("temp") || (clone6.GetDirtyBytes() != 0) ||
+		!clone6.Flush() || clone6.FindObject("gain") || clone6.FindObject("temp") ||
+		(clone6.ReadObject<uint16_t>("temp", 0) != 0) )
+	{
+		printf("Deleted object resurrected by flush\n");
+		return 1;
+	}
+
+	//Snapshots include pending content
+	clone6.StoreObjectDeferred("gain", (uint8_t*)&gain, sizeof(gain), 400);
+	SnapshotBuffer cacheSnapshot;
+	if(!clone6.ExportSnapshot(&cacheSnapshot) || (clone6.GetDirtyBytes() != 0) || !clone6.FindObject("gain") )
+	{
+		printf("Deferred write missing from snapshot\n");
+		return 1;
+	}
+	#endif
+
+	printf("WRITE CACHE\n");
+	PrintState(clone6);
+
+	//Compare-and-swap stores only succeed against the current revision
+	uint32_t seqno = 1;
+	uint64_t rev = clone6.GetRevision("seqno");
+	if( (clone6.StoreObjectIfRevision("seqno", rev, (uint8_t*)&seqno, sizeof(seqno)) != KVS::REVISION_STORED) ||
+		(clone6.StoreObjectIfRevision("seqno", rev, (uint8_t*)&seqno, sizeof(seqno)) != KVS::REVISION_CHANGED) ||
+		(clone6.GetRevision(clone6.FindObject("seqno")) != clone6.GetRevision("seqno")) )
+	{
+		printf("Revision not checked\n");
+		return 1;
+	}
+	rev = clone6.GetRevision("seqno");
+	clone6.DeleteObject("seqno");
+	if( (clone6.StoreObjectIfRevision("seqno", rev, (uint8_t*)&seqno, sizeof(seqno)) != KVS::REVISION_CHANGED) ||
+		(clone6.StoreObjectIfRevision("seqno", clone6.GetRevision("seqno"), (uint8_t*)&seqno, sizeof(seqno)) !=
+			KVS::REVISION_STORED) )
+	{
+		printf("Deletion didn't change the revision\n");
+		return 1;
+	}
+
+	//Counters and rewritable objects change without a new revision, so can't be overwritten this way
+	uint32_t hits = 0;
+	if(!clone6.StoreCounter("hits", 5))
+		return 1;
+	rev = clone6.GetRevision("hits");
+	hits = clone6.ReadObject<uint32_t>("hits", 0) + 10;
+	clone6.IncrementCounter("hits");
+	if( (clone6.StoreObjectIfRevision("hits", rev, (uint8_t*)&hits, sizeof(hits)) != KVS::REVISION_UNSUPPORTED) ||
+		(clone6.ReadObject<uint32_t>("hits", 0) != 6) )
+	{
+		printf("Counter increment lost by revision check\n");
+		return 1;
+	}
+	#if !defined(MICROKVS_WRITE_BLOCK_SIZE) && !defined(MICROKVS_CONCURRENT_READERS)
+	uint8_t mode[4] = {0xff, 0xff, 0xff, 0xff};
+	if(!clone6.StoreRewritableObject("mode", mode, sizeof(mode)))
+		return 1;
+	if(clone6.StoreObjectIfRevision("mode", clone6.GetRevision("mode"), mode, sizeof(mode)) != KVS::REVISION_UNSUPPORTED)
+	{
+		printf("Rewritable object overwritten by revision check\n");
+		return 1;
+	}
+	#endif
+
+	printf("REVISIONS\n");
+	PrintState(clone6);
+
+	//Banks written before log entries had flags are converted at startup
+	TestStorageBank legacyLeft;
+	TestStorageBank legacyRight;
+	if(!BuildLegacyBank(legacyLeft))
+		return 1;
+	KVS migrated(&legacyLeft, &legacyRight, 64);
+	uint8_t legacyData[8] = {0};
+	if( (migrated.GetBankHeaderVersion() != 4) || !migrated.ReadObject("config", legacyData, sizeof(legacyData)) ||
+		(memcmp(legacyData, "newer", 6) != 0) || migrated.FindObject("gone") || migrated.FindObject("bad") ||
+		!migrated.Compact() || !migrated.ReadObject("config", legacyData, sizeof(legacyData)) )
+	{
+		printf("Legacy bank not converted\n");
+		return 1;
+	}
+
+	printf("LEGACY\n");
+	PrintState(migrated);
+
 	return 0;
 }
 
+/**
+	@brief Log entry format used before log entries had a flags field
+ */
+struct LegacyLogEntry
+{
+	char		m_key[KVS_NAMELEN];
+	uint32_t	m_start;
+	uint32_t	m_len;
+	uint32_t	m_crc;
+	uint32_t	m_headerCRC;
+
+	#ifdef MICROKVS_WRITE_BLOCK_SIZE
+		#if MICROKVS_WRITE_BLOCK_SIZE >= 16
+			uint8_t		m_padding[MICROKVS_WRITE_BLOCK_SIZE - (16 % MICROKVS_WRITE_BLOCK_SIZE)];
+		#endif
+	#endif
+};
+
+/**
+	@brief Fills a bank with content in the legacy format: two revisions of "config", a deleted object "gone", and a
+	corrupted object "bad"
+ */
+bool BuildLegacyBank(TestStorageBank& bank)
+{
+	const uint32_t logSize = 16;
+	uint32_t header[3] = {0xc0def00d, 3, logSize};
+	memcpy(bank.GetBase(), header, sizeof(header));
+
+	const char* names[5] = {"config", "gone", "config", "gone", "bad"};
+	const char* contents[5] = {"older", "x", "newer", "", "junk"};
+	auto log = reinterpret_cast<LegacyLogEntry*>(bank.GetBase() + sizeof(BankHeader));
+	uint32_t data = sizeof(BankHeader) + logSize*sizeof(LegacyLogEntry);
+	for(int i=0; i<5; i++)
+	{
+		auto& e = log[i];
+		memset(&e, 0, sizeof(e));
+		strncpy(e.m_key, names[i], KVS_NAMELEN);
+		e.m_start = data;
+		e.m_len = strlen(contents[i]) + (contents[i][0] ? 1 : 0);
+		memcpy(bank.GetBase() + data, contents[i], e.m_len);
+		e.m_crc = bank.CRC(bank.GetBase() + data, e.m_len);
+		e.m_headerCRC = bank.CRC((const uint8_t*)&e, KVS_NAMELEN + 2*sizeof(uint32_t));
+		data += 16;
+	}
+	log[4].m_crc ^= 1;
+	return true;
+}
+
 bool WriteAndVerify(KVS& kvs, const char* name, uint8_t* data, uint32_t len)
 {
 	if(!kvs.StoreObject(name, data, len))
@@ -134,6 +1036,13 @@ bool Verify(KVS& kvs, const char* name, uint8_t* data, uint32_t len)
 		printf("Log entry length is wrong\n");
 		return false;
 	}
+	//(inline objects live in the log entry and are only 32-bit aligned)
+	if( !(log->m_flags & LogEntry::FLAG_INLINE) &&
+		(reinterpret_cast<uintptr_t>(kvs.MapObject(log)) % MICROKVS_DATA_ALIGNMENT) )
+	{
+		printf("Object content is misaligned\n");
+		return false;
+	}
 	if(memcmp(data, kvs.MapObject(log), log->m_len) != 0)
 	{
 		printf("Object content is wrong\n");
@@ -142,6 +1051,34 @@ bool Verify(KVS& kvs, const char* name, uint8_t* data, uint32_t len)
 	return true;
 }
 
+bool VerifyRead(KVS& kvs, const char* name, const uint8_t* data, uint32_t len)
+{
+	auto log = kvs.FindObject(name);
+	if(!log)
+	{
+		printf("Object couldn't be found\n");
+		return false;
+	}
+	if(kvs.GetObjectSize(log) != len)
+	{
+		printf("Object size is wrong\n");
+		return false;
+	}
+
+	uint8_t buf[1024];
+	if(!kvs.ReadObject(name, buf, sizeof(buf)))
+	{
+		printf("Object couldn't be read\n");
+		return false;
+	}
+	if(memcmp(data, buf, len) != 0)
+	{
+		printf("Object content is wrong\n");
+		return false;
+	}
+	return true;
+}
+
 void PrintState(KVS& kvs)
 {
 	if(kvs.IsLeftBankActive())
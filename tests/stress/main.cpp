@@ -0,0 +1,229 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* microkvs v0.1                                                                                                        *
+*                                                                                                                      *
+* Copyright (c) 2021 Andrew D. Zonenberg and contributors                                                              *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief	Multi-threaded stress test and benchmark for concurrent readers (MICROKVS_CONCURRENT_READERS)
+
+	One writer thread continuously rewrites a set of objects, forcing frequent compactions, while several reader
+	threads look objects up and check their content is self consistent while holding a KVSReadLock. Any reader which
+	sees torn or erased content reports an error.
+
+	Afterwards, several threads increment a shared counter with StoreObjectIfRevision() retry loops, and the final
+	value is checked to make sure no increment was lost.
+ */
+
+#include <kvs/KVS.h>
+#include <driver/TestStorageBank.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifndef MICROKVS_CONCURRENT_READERS
+#error The stress test must be built with MICROKVS_CONCURRENT_READERS defined
+#endif
+
+#define NUM_KEYS	8
+#define NUM_READERS	4
+#define NUM_CAS_INCREMENTS	200
+
+struct StressObject
+{
+	uint32_t	key;
+	uint32_t	seq;
+	uint8_t		fill[48];
+	uint32_t	check;
+};
+
+void FillObject(StressObject& obj, uint32_t key, uint32_t seq);
+bool CheckObject(const StressObject& obj, uint32_t key);
+
+TestStorageBank g_left;
+TestStorageBank g_right;
+
+std::atomic<bool> g_done(false);
+std::atomic<uint64_t> g_reads(0);
+std::atomic<uint64_t> g_misses(0);
+std::atomic<uint64_t> g_errors(0);
+
+int main(int argc, char* argv[])
+{
+	double seconds = 2;
+	if(argc > 1)
+		seconds = atof(argv[1]);
+
+	//Small log so we compact often
+	KVS kvs(&g_left, &g_right, 32);
+	uint32_t firstVersion = kvs.GetBankHeaderVersion();
+
+	//Populate every key before starting the readers
+	char name[KVS_NAMELEN+1] = {0};
+	StressObject obj;
+	for(uint32_t k=0; k<NUM_KEYS; k++)
+	{
+		snprintf(name, sizeof(name), "stress%u", k);
+		FillObject(obj, k, 0);
+		kvs.StoreObject(name, (const uint8_t*)&obj, sizeof(obj));
+	}
+
+	std::thread readers[NUM_READERS];
+	for(int r=0; r<NUM_READERS; r++)
+	{
+		readers[r] = std::thread([&kvs, r]()
+		{
+			uint32_t state = r + 1;
+			uint64_t reads = 0;
+			char rname[KVS_NAMELEN+1] = {0};
+			while(!g_done)
+			{
+				state = state * 1103515245 + 12345;
+				uint32_t k = (state >> 16) % NUM_KEYS;
+				snprintf(rname, sizeof(rname), "stress%u", k);
+
+				KVSReadLock lock(&kvs);
+				auto log = kvs.FindObject(rname);
+				if(!log)
+				{
+					g_misses ++;
+					continue;
+				}
+
+				//Check the mapped content, then again after giving the writer a chance to compact under us
+				auto p = reinterpret_cast<const StressObject*>(kvs.MapObject(log));
+				if( (log->m_len != sizeof(StressObject)) || !CheckObject(*p, k) )
+					g_errors ++;
+				std::this_thread::yield();
+				if(!CheckObject(*p, k))
+					g_errors ++;
+				reads ++;
+			}
+			g_reads += reads;
+		});
+	}
+
+	//Writer
+	auto start = std::chrono::steady_clock::now();
+	uint64_t writes = 0;
+	uint64_t failures = 0;
+	for(uint32_t seq = 1; ; seq++)
+	{
+		std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+		if(dt.count() >= seconds)
+			break;
+
+		uint32_t k = seq % NUM_KEYS;
+		snprintf(name, sizeof(name), "stress%u", k);
+		FillObject(obj, k, seq);
+		if(kvs.StoreObject(name, (const uint8_t*)&obj, sizeof(obj)))
+			writes ++;
+		else
+			failures ++;
+	}
+	g_done = true;
+	for(int r=0; r<NUM_READERS; r++)
+		readers[r].join();
+
+	//Lock-free increments of a shared counter
+	std::atomic<uint64_t> casRetries(0);
+	std::atomic<uint64_t> casFailures(0);
+	for(int r=0; r<NUM_READERS; r++)
+	{
+		readers[r] = std::thread([&kvs, &casRetries, &casFailures]()
+		{
+			for(int i=0; i<NUM_CAS_INCREMENTS; i++)
+			{
+				while(true)
+				{
+					uint32_t value = 0;
+					uint64_t rev;
+					{
+						KVSReadLock lock(&kvs);
+						auto log = kvs.FindObject("cas");
+						if(log)
+							kvs.ReadObject(log, (uint8_t*)&value, sizeof(value));
+						rev = log ? kvs.GetRevision(log) : kvs.GetRevision("cas");
+					}
+					value ++;
+					auto status = kvs.StoreObjectIfRevision("cas", rev, (uint8_t*)&value, sizeof(value));
+					if(status == KVS::REVISION_STORED)
+						break;
+					if( (status != KVS::REVISION_CHANGED) && (status != KVS::REVISION_BUSY) )
+					{
+						casFailures ++;
+						break;
+					}
+					casRetries ++;
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	for(int r=0; r<NUM_READERS; r++)
+		readers[r].join();
+	uint32_t casValue = kvs.ReadObject<uint32_t>("cas", 0);
+
+	uint32_t compactions = kvs.GetBankHeaderVersion() - firstVersion;
+	printf("Duration:     %.2f s\n", seconds);
+	printf("Readers:      %d\n", NUM_READERS);
+	printf("Reads:        %llu (%.0f / s)\n", (unsigned long long)g_reads, g_reads / seconds);
+	printf("Misses:       %llu\n", (unsigned long long)g_misses);
+	printf("Writes:       %llu (%.0f / s)\n", (unsigned long long)writes, writes / seconds);
+	printf("Compactions:  %u\n", compactions);
+	printf("Write errors: %llu\n", (unsigned long long)failures);
+	printf("Read errors:  %llu\n", (unsigned long long)g_errors);
+	printf("CAS value:    %u (%llu retries)\n", casValue, (unsigned long long)casRetries);
+	printf("CAS errors:   %llu\n", (unsigned long long)casFailures);
+
+	if(g_errors || g_misses || failures || casFailures || (casValue != NUM_READERS * NUM_CAS_INCREMENTS) )
+		return 1;
+	return 0;
+}
+
+void FillObject(StressObject& obj, uint32_t key, uint32_t seq)
+{
+	obj.key = key;
+	obj.seq = seq;
+	for(uint32_t i=0; i<sizeof(obj.fill); i++)
+		obj.fill[i] = key + seq + i;
+	obj.check = key ^ seq ^ 0x5a5a5a5a;
+}
+
+bool CheckObject(const StressObject& obj, uint32_t key)
+{
+	if(obj.key != key)
+		return false;
+	for(uint32_t i=0; i<sizeof(obj.fill); i++)
+	{
+		if(obj.fill[i] != (uint8_t)(key + obj.seq + i))
+			return false;
+	}
+	return obj.check == (key ^ obj.seq ^ 0x5a5a5a5a);
+}